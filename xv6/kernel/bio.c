@@ -12,6 +12,8 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * To start reading a block that will be wanted soon,
+//     call bprefetch; a later bread waits for it.
 
 
 #include "types.h"
@@ -26,6 +28,7 @@
 struct {
   struct spinlock lock;
   struct buf buf[NBUF];
+  int nprefetch;  // prefetches in flight
 
   // Linked list of all buffers, through prev/next.
   // Sorted by how recently the buffer was used.
@@ -102,6 +105,31 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Like bread, but only if the cache holds the block (perhaps
+// with a read still in flight). Returns 0 otherwise, so that
+// the caller can read it from the disk without the cache.
+struct buf*
+bcached(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  acquire(&bcache.lock);
+  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      release(&bcache.lock);
+      acquiresleep(&b->lock);
+      if(!b->valid){
+        virtio_disk_rw(b, 0);
+        b->valid = 1;
+      }
+      return b;
+    }
+  }
+  release(&bcache.lock);
+  return 0;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,17 +139,12 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
-// Release a locked buffer.
-// Move to the head of the most-recently-used list.
-void
-brelse(struct buf *b)
+// Drop a reference to b, moving it to the head of the
+// most-recently-used list once it is unused.
+// Caller holds bcache.lock.
+static void
+bput(struct buf *b)
 {
-  if(!holdingsleep(&b->lock))
-    panic("brelse");
-
-  releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
@@ -132,7 +155,19 @@ brelse(struct buf *b)
     bcache.head.next->prev = b;
     bcache.head.next = b;
   }
-  
+}
+
+// Release a locked buffer.
+void
+brelse(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("brelse");
+
+  releasesleep(&b->lock);
+
+  acquire(&bcache.lock);
+  bput(b);
   release(&bcache.lock);
 }
 
@@ -150,4 +185,69 @@ bunpin(struct buf *b) {
   release(&bcache.lock);
 }
 
+// Start reading the indicated block into the cache without
+// waiting for it. The buffer stays locked until the read
+// completes, so a bread of the block meanwhile just sleeps
+// until the data is there.
+// Returns 0 if the block is cached or on its way, -1 if no
+// buffer or disk descriptor is free to prefetch it with.
+int
+bprefetch(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  acquire(&bcache.lock);
+  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      release(&bcache.lock);
+      return 0;
+    }
+  }
+
+  // leave enough buffers for the log and for bread.
+  if(bcache.nprefetch >= 2*RAMAX){
+    release(&bcache.lock);
+    return -1;
+  }
+  for(b = bcache.head.prev; b != &bcache.head; b = b->prev)
+    if(b->refcnt == 0)
+      break;
+  if(b == &bcache.head){
+    release(&bcache.lock);
+    return -1;
+  }
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  bcache.nprefetch++;
+  release(&bcache.lock);
+
+  // a bread of the block may have got the lock first
+  // and read it already.
+  acquiresleep(&b->lock);
+  if(b->valid){
+    bdone(b);
+    return 0;
+  }
+  if(virtio_disk_prefetch(b) < 0){
+    bdone(b);
+    return -1;
+  }
+  return 0;
+}
+
+// Called when a prefetch of b is over: unlock b and drop the
+// prefetch's reference. Runs in the disk interrupt, so it
+// cannot check that the caller holds the lock the way brelse
+// does.
+void
+bdone(struct buf *b)
+{
+  releasesleep(&b->lock);
 
+  acquire(&bcache.lock);
+  bcache.nprefetch--;
+  bput(b);
+  release(&bcache.lock);
+}
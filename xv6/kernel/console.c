@@ -16,6 +16,7 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
+#include "readahead.h"
 #include "file.h"
 #include "memlayout.h"
 #include "riscv.h"
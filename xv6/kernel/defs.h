@@ -9,14 +9,21 @@ struct sleeplock;
 struct stat;
 struct superblock;
 struct vma;
+struct mmapstat;
+struct kmemstat;
+struct kmem_cache;
+struct ra_state;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bcached(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bprefetch(uint, uint);
+void            bdone(struct buf*);
 
 // console.c
 void            consoleinit(void);
@@ -34,6 +41,8 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             ipread(struct inode*, int, uint64, uint, int);
+int             ipwrite(struct inode*, int, uint64, uint, int, int);
 
 // fs.c
 void            fsinit(int);
@@ -51,6 +60,9 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            readahead(struct inode*, struct ra_state*, uint, uint);
+uint            iprefetch(struct inode*, uint, uint);
+void            readpage(struct inode*, uint, char*);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
@@ -64,6 +76,14 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kaddref(void *);
+int             krefcount(void *);
+void*           kalloc_zeroed(void);
+int             kzero_idle(void);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
+void            kaddref_order(void *, int);
+void            kmemstat(struct kmemstat*);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -71,7 +91,15 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// pcache.c
+void            pcacheinit(void);
+char*           pcache_get(struct inode*, uint, int);
+char*           pcache_peek(struct inode*, uint);
+void            pcache_update(struct inode*, uint, void*, uint);
+void            pcache_drop(struct inode*);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -87,6 +115,7 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
+void            kthread(void (*)(void), char*);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -107,7 +136,7 @@ int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 //mp2
-int             writepage(struct vma *, struct file *, uint64, int);
+int             writepage(struct vma *, struct file *, uint64, uint, int);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -145,12 +174,15 @@ void            syscall();
 
 // trap.c
 extern uint     ticks;
+extern struct mmapstat mmstat;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
 //mp2
 int             mmap_allocate(uint64, int, struct proc*);
+int             page_fault(struct proc*, uint64, int);
+void            prefault(uint64, uint64, int);
 
 // uart.c
 void            uartinit(void);
@@ -168,11 +200,20 @@ pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             uvmmove(pagetable_t, uint64, uint64, uint64);
+int             uvmlazy(pagetable_t, uint64, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
+pte_t*          walk(pagetable_t, uint64, int);
+pte_t*          walkleaf(pagetable_t, uint64, uint64*);
+int             megaempty(pagetable_t, uint64);
+int             mapmega(pagetable_t, uint64, uint64, int);
+int             uvmdemote(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -180,15 +221,47 @@ int             copyinstr(pagetable_t, char *, uint64, uint64);
 uint64          uvmalloc_prot(pagetable_t, uint64, uint64, int);
 void            vmprint(pagetable_t);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint, void (*)(void*));
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
 // plic.c
 void            plicinit(void);
 void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
 
+// vma.c
+void            vmainit(void);
+struct vma*     vma_find(struct proc*, uint64);
+struct vma*     vma_insert(struct proc*, uint64, uint64);
+void            vma_remove(struct proc*, struct vma*);
+struct vma*     vma_split(struct proc*, struct vma*, uint64);
+struct vma*     vma_overlap(struct proc*, uint64, uint64);
+int             vma_inrange(struct proc*, uint64, uint64);
+int             vma_fits(struct proc*, uint64, uint64);
+uint64          vma_gap(struct proc*, uint64);
+int             vma_unmap(struct proc*, struct vma*, uint64, uint64);
+int             vma_unmap_range(struct proc*, uint64, uint64);
+void            vma_unmap_all(struct proc*);
+int             vma_fork(struct proc*, struct proc*);
+void            vma_free_all(struct proc*);
+int             vma_perm(struct vma*);
+int             vma_populate(struct proc*, struct vma*, uint64, uint64);
+int             vma_advise(struct proc*, struct vma*, uint64, uint64, int);
+int             vma_protect(struct proc*, struct vma*, uint64, uint64, int);
+uint64          vma_remap(struct proc*, struct vma*, uint64, int);
+void            vma_sync(struct proc*, struct vma*, uint64, uint64, int);
+void            vma_flusher(void);
+extern char     *zeropage;
+
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_prefetch(struct buf *);
+void            virtio_disk_read(uint *, int, char *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "readahead.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
@@ -108,6 +109,10 @@ exec(char *path, char **argv)
             last = s+1;
     safestrcpy(p->name, last, sizeof(p->name));
         
+    // mp2
+    // mappings of the old image do not survive exec.
+    vma_unmap_all(p);
+
     // Commit to the user image.
     oldpagetable = p->pagetable;
     p->pagetable = pagetable;
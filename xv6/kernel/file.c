@@ -9,38 +9,38 @@
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "readahead.h"
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
 
 struct devsw devsw[NDEV];
+
+// file structures come from a slab cache, so there is no fixed
+// limit on open files; the lock protects their reference counts.
 struct {
     struct spinlock lock;
-    struct file file[NFILE];
+    struct kmem_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
     initlock(&ftable.lock, "ftable");
+    ftable.cache = kmem_cache_create("file", sizeof(struct file), 0);
 }
 
-// Allocate a file structure.
+// Allocate a file structure, or return 0 if out of memory.
 struct file*
 filealloc(void)
 {
     struct file *f;
 
-    acquire(&ftable.lock);
-    for(f = ftable.file; f < ftable.file + NFILE; f++){
-        if(f->ref == 0){
-            f->ref = 1;
-            release(&ftable.lock);
-            return f;
-        }
-    }
-    release(&ftable.lock);
-    return 0;
+    if((f = kmem_cache_alloc(ftable.cache)) == 0)
+        return 0;
+    memset(f, 0, sizeof(*f));
+    f->ref = 1;
+    return f;
 }
 
 // Increment ref count for file f.
@@ -72,6 +72,7 @@ fileclose(struct file *f)
     f->ref = 0;
     f->type = FD_NONE;
     release(&ftable.lock);
+    kmem_cache_free(ftable.cache, f);
 
     if(ff.type == FD_PIPE){
         pipeclose(ff.pipe, ff.writable);
@@ -101,6 +102,59 @@ filestat(struct file *f, uint64 addr)
     return -1;
 }
 
+// Read n bytes of ip at off into dst, a user virtual address
+// if user_dst==1 or else a kernel one, without any file offset.
+// Returns the number of bytes read, or -1 on error.
+int
+ipread(struct inode *ip, int user_dst, uint64 dst, uint off, int n)
+{
+    int r;
+
+    ilock(ip);
+    r = readi(ip, user_dst, dst, off, n);
+    iunlock(ip);
+    return r;
+}
+
+// Write n bytes from src, a user virtual address if user_src==1
+// or else a kernel one, to ip at off, without any file offset,
+// in as many log transactions as it takes. If extend is 0, only
+// data the file already has is rewritten; that allocates nothing,
+// so each transaction can carry a data block for every slot but
+// the inode's, which is two whole pages.
+// Returns the number of bytes written, or -1 on error.
+int
+ipwrite(struct inode *ip, int user_src, uint64 src, uint off, int n, int extend)
+{
+    int r = 0, i = 0, n1;
+    int max = extend ? ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE
+                     : (MAXOPBLOCKS-2) * BSIZE;
+
+    while(i < n){
+        n1 = n - i;
+        if(n1 > max)
+            n1 = max;
+
+        begin_op();
+        ilock(ip);
+        if(!extend && off + i >= ip->size)
+            n1 = 0;
+        else if(!extend && n1 > ip->size - (off + i))
+            n1 = ip->size - (off + i);
+        if(n1 > 0)
+            r = writei(ip, user_src, src + i, off + i, n1);
+        iunlock(ip);
+        end_op();
+
+        if(n1 == 0)
+            break;
+        if(r != n1)
+            return i > 0 ? i : -1;
+        i += r;
+    }
+    return i;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -111,6 +165,7 @@ fileread(struct file *f, uint64 addr, int n)
     if(f->readable == 0)
         return -1;
 
+    prefault(addr, n, 1);
     if(f->type == FD_PIPE){
         r = piperead(f->pipe, addr, n);
     } else if(f->type == FD_DEVICE){
@@ -119,6 +174,7 @@ fileread(struct file *f, uint64 addr, int n)
         r = devsw[f->major].read(1, addr, n);
     } else if(f->type == FD_INODE){
         ilock(f->ip);
+        readahead(f->ip, &f->ra, f->off, n);
         if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
             f->off += r;
         iunlock(f->ip);
@@ -139,6 +195,7 @@ filewrite(struct file *f, uint64 addr, int n)
     if(f->writable == 0)
         return -1;
 
+    prefault(addr, n, 0);
     if(f->type == FD_PIPE){
         ret = pipewrite(f->pipe, addr, n);
     } else if(f->type == FD_DEVICE){
@@ -6,6 +6,7 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  struct ra_state ra; // FD_INODE, readahead for read()
   short major;       // FD_DEVICE
 };
 
@@ -18,6 +19,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int cached;         // pages in the mmap page cache, under pcache.lock
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -15,6 +15,7 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "readahead.h"
 #include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
@@ -353,6 +354,8 @@ iput(struct inode *ip)
     acquire(&icache.lock);
   }
 
+  if(ip->ref == 1)
+    pcache_drop(ip);
   ip->ref--;
   release(&icache.lock);
 }
@@ -404,6 +407,29 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Like bmap, but return 0 rather than allocate
+// a block that is not there.
+static uint
+bmapped(struct inode *ip, uint bn)
+{
+  uint addr;
+  struct buf *bp;
+
+  if(bn < NDIRECT)
+    return ip->addrs[bn];
+  bn -= NDIRECT;
+
+  if(bn < NINDIRECT){
+    if((addr = ip->addrs[NDIRECT]) == 0)
+      return 0;
+    bp = bread(ip->dev, addr);
+    addr = ((uint*)bp->data)[bn];
+    brelse(bp);
+    return addr;
+  }
+  return 0;
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -413,6 +439,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  pcache_drop(ip);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -476,6 +504,103 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Readahead.
+//
+// Called before reading n bytes at off, with ra the state of
+// the open file or mmap region being read. A read that starts
+// where the last one ended, or inside the blocks already
+// prefetched for it, is sequential: every sequential read
+// doubles the window, up to RAMAX blocks, and the blocks of
+// the read plus a window beyond it are started with bprefetch,
+// so the disk works ahead of the reader instead of one block
+// at a time under it. Any other read resets the window.
+// Caller must hold ip->lock.
+#define RAMIN 2
+
+void
+readahead(struct inode *ip, struct ra_state *ra, uint off, uint n)
+{
+  uint bn, end, last;
+
+  if(off >= ip->size || n == 0)
+    return;
+  if(n > ip->size - off)
+    n = ip->size - off;
+
+  if(off >= ra->end && off <= (ra->ahead > ra->end ? ra->ahead : ra->end)){
+    if(ra->win == 0)
+      ra->win = RAMIN;
+    else if(ra->win < RAMAX)
+      ra->win *= 2;
+  } else {
+    ra->win = 0;
+    ra->ahead = 0;
+  }
+  ra->end = off + n;
+
+  // a random read within one block gains nothing.
+  bn = off / BSIZE;
+  end = (off + n - 1) / BSIZE + 1;
+  if(ra->win == 0 && end - bn == 1)
+    return;
+
+  last = end + ra->win;
+  if(bn < ra->ahead / BSIZE)
+    bn = ra->ahead / BSIZE;
+  if(bn < last)
+    ra->ahead = iprefetch(ip, bn * BSIZE, (last - bn) * BSIZE);
+}
+
+// Start reading the blocks that hold [off, off+n) of ip,
+// for as many as bprefetch has room. Returns the offset
+// up to which reads have been started.
+// Caller must hold ip->lock.
+uint
+iprefetch(struct inode *ip, uint off, uint n)
+{
+  uint bn, last, addr;
+
+  if(off >= ip->size)
+    return off;
+  if(n > ip->size - off)
+    n = ip->size - off;
+  last = (off + n + BSIZE - 1) / BSIZE;
+  for(bn = off / BSIZE; bn < last; bn++){
+    if((addr = bmapped(ip, bn)) == 0 || bprefetch(ip->dev, addr) < 0)
+      break;
+  }
+  return bn * BSIZE > off ? bn * BSIZE : off;
+}
+
+// Fill the page pa with page pgoff of ip. Blocks the buffer
+// cache holds are copied from it, since they may be newer than
+// the disk; the rest are read by the disk straight into pa, all
+// at once. Bytes past the end of the file read as zero.
+// Caller must hold ip->lock, so no block of ip that is not
+// cached can be written meanwhile.
+void
+readpage(struct inode *ip, uint pgoff, char *pa)
+{
+  uint blocks[PGSIZE/BSIZE], off = pgoff * PGSIZE, i;
+  struct buf *bp;
+
+  for(i = 0; i < PGSIZE/BSIZE; i++){
+    blocks[i] = 0;
+    if(off + i*BSIZE >= ip->size ||
+       (blocks[i] = bmapped(ip, off / BSIZE + i)) == 0){
+      memset(pa + i*BSIZE, 0, BSIZE);
+    } else if((bp = bcached(ip->dev, blocks[i])) != 0){
+      memmove(pa + i*BSIZE, bp->data, BSIZE);
+      brelse(bp);
+      blocks[i] = 0;
+    }
+  }
+  virtio_disk_read(blocks, PGSIZE/BSIZE, pa);
+  // the rest of the last block need not be zero on disk.
+  if(off < ip->size && ip->size - off < PGSIZE)
+    memset(pa + (ip->size - off), 0, PGSIZE - (ip->size - off));
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -501,6 +626,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    pcache_update(ip, off, bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
   }
@@ -1,6 +1,7 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// and naturally aligned blocks of 2^order pages.
 
 #include "types.h"
 #include "param.h"
@@ -8,6 +9,7 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "kmemstat.h"
 
 void freerange(void *pa_start, void *pa_end);
 
@@ -16,50 +18,366 @@ extern char end[]; // first address after kernel.
 
 struct run {
     struct run *next;
+    struct run *prev;   // only on the buddy free lists
 };
 
-struct {
+// every allocated page carries a reference count, so that a
+// frame can be mapped by several page tables and held by the
+// page cache at once. kfree() drops one reference and only
+// returns the page to the free list when the last one goes.
+// the counts are updated with atomic instructions rather than
+// under a lock.
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define REF2PA(i) (KERNBASE + (uint64)(i) * PGSIZE)
+#define NPAGE PA2REF(PHYSTOP)
+
+// free memory is kept by a buddy allocator: a free block of
+// 2^k pages starts at a page index that is a multiple of 2^k,
+// and when both halves of a 2^(k+1) block are free they are
+// merged. KERNBASE is aligned far beyond 2^MAXORDER pages, so
+// page index alignment is physical alignment as well.
+// state[i] is FREE|k if page i starts a free block of order k.
+#define FREE 0x80
+
+// each CPU allocates single pages from and frees them to its
+// own list, under its own lock, so harts faulting or forking at
+// once do not queue on one lock. a CPU whose list is empty takes
+// a batch of STEAL pages from the buddy allocator, or failing
+// that from another CPU; one whose list reaches KCACHE pages
+// gives half back, so that they can coalesce again.
+#define STEAL 64
+#define KCACHE (4*STEAL)
+
+// each CPU also keeps up to NZEROED pages that it zeroed while
+// it had nothing to run, for kalloc_zeroed(), so that page
+// faults and page-table growth need not clear them on the spot.
+#define NZEROED 32
+
+// kalloc_order() gives the CPU lists back to the buddy allocator
+// when no block is free, in case they hold the missing pages. if
+// that still finds none, memory is fragmented and the next
+// DRAINGAP ticks do not try again, so that large allocations do
+// not empty the CPU lists and take kmem.lock every time.
+#define DRAINGAP 10
+
+// debug fills, chosen with KDEBUG in the Makefile. POISON fills
+// freed pages with 1s and allocated ones with 5s, to catch
+// dangling references and reads of memory never written.
+// CANARY keeps a word at the end of every free page and checks it
+// on allocation, which catches most writes after free for one
+// store and one load a page. Without either, allocation and free
+// touch only the free lists.
+#define KDEBUG_POISON 1
+#define KDEBUG_CANARY 2
+#define CANARY 0x6b667265656b6672L
+#define CANARYP(pa) ((uint64*)((char*)(pa) + PGSIZE) - 1)
+
+struct kcpu {
     struct spinlock lock;
     struct run *freelist;
+    int n;              // pages on freelist
+    struct run *zeroed;
+    int nzeroed;        // pages on zeroed
+};
+
+struct {
+    struct spinlock lock;   // protects the buddy state below
+    struct run *free[MAXORDER+1];
+    uint64 nfree[MAXORDER+1];
+    uint64 failed[MAXORDER+1];
+    uchar state[NPAGE];
+    struct kcpu cpu[NCPU];
+    uint64 zero_hits;       // kalloc_zeroed() calls served by a pool
+    uint64 zero_misses;     // and those that had to clear a page
+    uint nextdrain;         // ticks before which kalloc_order() does not drain
+    int ref[NPAGE];
 } kmem;
 
 void
 kinit()
 {
     initlock(&kmem.lock, "kmem");
+    for(int i = 0; i < NCPU; i++)
+        initlock(&kmem.cpu[i].lock, "kmem.cpu");
     freerange(end, (void*)PHYSTOP);
 }
 
+// Mark the page at pa free for the debug mode in use.
+static void
+free_fill(void *pa)
+{
+#if KDEBUG == KDEBUG_POISON
+    memset(pa, 1, PGSIZE);
+#elif KDEBUG == KDEBUG_CANARY
+    *CANARYP(pa) = CANARY;
+#endif
+}
+
+// Check and fill the newly allocated page at pa for the debug
+// mode in use.
+static void
+alloc_fill(void *pa)
+{
+#if KDEBUG == KDEBUG_POISON
+    memset(pa, 5, PGSIZE);
+#elif KDEBUG == KDEBUG_CANARY
+    if(*CANARYP(pa) != CANARY)
+        panic("kalloc: free page was written");
+#endif
+}
+
+// Take block i of order k off its free list.
+// Caller holds kmem.lock.
+static void
+list_remove(uint64 i, int k)
+{
+    struct run *r = (struct run*)REF2PA(i);
+
+    if(r->prev)
+        r->prev->next = r->next;
+    else
+        kmem.free[k] = r->next;
+    if(r->next)
+        r->next->prev = r->prev;
+    kmem.state[i] = 0;
+    kmem.nfree[k]--;
+}
+
+// Put block i of order k on its free list.
+// Caller holds kmem.lock.
+static void
+list_add(uint64 i, int k)
+{
+    struct run *r = (struct run*)REF2PA(i);
+
+    r->prev = 0;
+    r->next = kmem.free[k];
+    if(r->next)
+        r->next->prev = r;
+    kmem.free[k] = r;
+    kmem.state[i] = FREE | k;
+    kmem.nfree[k]++;
+}
+
+// Free the block of 2^k pages at pa, merging it with its buddy
+// for as long as that is free too. Caller holds kmem.lock.
+static void
+buddy_free(void *pa, int k)
+{
+    uint64 i = PA2REF(pa), b;
+
+    for(; k < MAXORDER; k++){
+        b = i ^ (1L << k);
+        if(b >= NPAGE || kmem.state[b] != (FREE | k))
+            break;
+        list_remove(b, k);
+        if(b < i)
+            i = b;
+    }
+    list_add(i, k);
+}
+
+// Allocate a block of 2^k pages, splitting a larger one if
+// need be. Returns 0 if none is free. Caller holds kmem.lock.
+static void *
+buddy_alloc(int k)
+{
+    uint64 i;
+    int j;
+
+    for(j = k; j <= MAXORDER && kmem.free[j] == 0; j++)
+        ;
+    if(j > MAXORDER)
+        return 0;
+    i = PA2REF(kmem.free[j]);
+    list_remove(i, j);
+    // give back the upper half of each split.
+    while(j > k){
+        j--;
+        list_add(i + (1L << j), j);
+    }
+    return (void*)REF2PA(i);
+}
+
 void
 freerange(void *pa_start, void *pa_end)
 {
     char *p;
     p = (char*)PGROUNDUP((uint64)pa_start);
-    for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-        kfree(p);
+    acquire(&kmem.lock);
+    for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+        free_fill(p);
+        buddy_free(p, 0);
+    }
+    release(&kmem.lock);
+}
+
+// Give up to n pages of c's list back to the buddy allocator.
+static void
+drain(struct kcpu *c, int n)
+{
+    struct run *head, *r;
+
+    acquire(&c->lock);
+    head = c->freelist;
+    for(r = head; n > 0 && r; n--, r = r->next)
+        c->n--;
+    c->freelist = r;
+    release(&c->lock);
+
+    acquire(&kmem.lock);
+    while(head != r){
+        struct run *next = head->next;
+        buddy_free(head, 0);
+        head = next;
+    }
+    release(&kmem.lock);
+}
+
+// Give all of c's zeroed pages back to the buddy allocator.
+static void
+drain_zeroed(struct kcpu *c)
+{
+    struct run *r, *next;
+
+    acquire(&c->lock);
+    r = c->zeroed;
+    c->zeroed = 0;
+    c->nzeroed = 0;
+    release(&c->lock);
+
+    acquire(&kmem.lock);
+    for(; r; r = next){
+        next = r->next;
+        kmem.ref[PA2REF(r)] = 0;
+        free_fill(r);
+        buddy_free(r, 0);
+    }
+    release(&kmem.lock);
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().    (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed at
+// by pa, which normally should have been returned by a call
+// to kalloc(), and free it once no references are left.
+// A page of a larger block may be freed on its own.
 void
 kfree(void *pa)
 {
     struct run *r;
+    struct kcpu *c;
+    int n;
 
     if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
         panic("kfree");
 
-    // Fill with junk to catch dangling refs.
-    memset(pa, 1, PGSIZE);
+    if((n = __sync_sub_and_fetch(&kmem.ref[PA2REF(pa)], 1)) < 0)
+        panic("kfree: ref");
+    if(n > 0)
+        return;
+
+    free_fill(pa);
 
     r = (struct run*)pa;
+    push_off();
+    c = &kmem.cpu[cpuid()];
+    acquire(&c->lock);
+    r->next = c->freelist;
+    c->freelist = r;
+    n = ++c->n;
+    release(&c->lock);
+    if(n >= KCACHE)
+        drain(c, KCACHE / 2);
+    pop_off();
+}
+
+// Add a reference to an allocated page.
+void
+kaddref(void *pa)
+{
+    if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+        panic("kaddref");
+
+    if(__sync_fetch_and_add(&kmem.ref[PA2REF(pa)], 1) < 1)
+        panic("kaddref: free page");
+}
+
+// Return the number of references to an allocated page.
+int
+krefcount(void *pa)
+{
+    return kmem.ref[PA2REF(pa)];
+}
+
+// Take up to STEAL pages from another CPU than id and return
+// them as a list, or 0 if every other list is empty. Only one
+// lock is held at a time, so two CPUs stealing from each other
+// cannot deadlock.
+static struct run*
+steal(int id)
+{
+    struct kcpu *c;
+    struct run *head, *tail;
+    int n;
+
+    for(int i = 1; i < NCPU; i++){
+        c = &kmem.cpu[(id + i) % NCPU];
+        if(c->freelist == 0)
+            continue;
+        acquire(&c->lock);
+        head = tail = c->freelist;
+        if(head == 0){
+            release(&c->lock);
+            continue;
+        }
+        for(n = 1; n < STEAL && tail->next; n++)
+            tail = tail->next;
+        c->freelist = tail->next;
+        c->n -= n;
+        release(&c->lock);
+        tail->next = 0;
+        return head;
+    }
+    return 0;
+}
+
+// Take up to STEAL pages from the buddy allocator as a list,
+// or 0 if it has none.
+static struct run*
+refill(void)
+{
+    struct run *head = 0, *r;
 
     acquire(&kmem.lock);
-    r->next = kmem.freelist;
-    kmem.freelist = r;
+    for(int n = 0; n < STEAL && (r = buddy_alloc(0)) != 0; n++){
+        r->next = head;
+        head = r;
+    }
     release(&kmem.lock);
+    return head;
+}
+
+// Take a page from the zeroed pool of CPU id, or of another
+// CPU if that one is empty. Returns 0 if all of them are.
+static struct run*
+take_zeroed(int id)
+{
+    struct kcpu *c;
+    struct run *r;
+
+    for(int i = 0; i < NCPU; i++){
+        c = &kmem.cpu[(id + i) % NCPU];
+        if(c->zeroed == 0)
+            continue;
+        acquire(&c->lock);
+        if((r = c->zeroed) != 0){
+            c->zeroed = r->next;
+            c->nzeroed--;
+        }
+        release(&c->lock);
+        if(r)
+            return r;
+    }
+    return 0;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -68,15 +386,240 @@ kfree(void *pa)
 void *
 kalloc(void)
 {
-    struct run *r;
+    struct run *r, *tail;
+    struct kcpu *c;
+    int id, n;
 
-    acquire(&kmem.lock);
-    r = kmem.freelist;
+    push_off();
+    id = cpuid();
+    c = &kmem.cpu[id];
+    acquire(&c->lock);
+    r = c->freelist;
+    if(r){
+        c->freelist = r->next;
+        c->n--;
+    }
+    release(&c->lock);
+    if(r == 0 && ((r = refill()) != 0 || (r = steal(id)) != 0) && r->next != 0){
+        // keep the rest of the batch for the next kalloc()s.
+        for(n = 1, tail = r->next; tail->next; tail = tail->next)
+            n++;
+        acquire(&c->lock);
+        tail->next = c->freelist;
+        c->freelist = r->next;
+        c->n += n;
+        release(&c->lock);
+    }
     if(r)
-        kmem.freelist = r->next;
-    release(&kmem.lock);
+        alloc_fill(r);
+    // the last free pages may be waiting zeroed.
+    if(r == 0)
+        r = take_zeroed(id);
+    pop_off();
 
     if(r)
-        memset((char*)r, 5, PGSIZE); // fill with junk
+        kmem.ref[PA2REF(r)] = 1;
+    return (void*)r;
+}
+
+// Allocate a page of zeros. Returns 0 if out of memory.
+// Pages that an idle CPU zeroed ahead are used first, so that
+// the caller need not wait for the clearing.
+void *
+kalloc_zeroed(void)
+{
+    struct run *r;
+
+    push_off();
+    r = take_zeroed(cpuid());
+    pop_off();
+    if(r){
+        // the link was written into the page.
+        r->next = 0;
+        __sync_fetch_and_add(&kmem.zero_hits, 1);
+        return (void*)r;
+    }
+    __sync_fetch_and_add(&kmem.zero_misses, 1);
+    if((r = kalloc()) != 0)
+        memset(r, 0, PGSIZE);
     return (void*)r;
 }
+
+// Zero a page for this CPU's pool, if it has room. Called by
+// the scheduler when it has nothing to run, with interrupts on,
+// so the clearing itself does not hold up interrupts.
+// The page comes from this CPU's list or the buddy allocator,
+// never from other CPUs or the zeroed pools themselves.
+// Returns 1 if it zeroed a page, 0 if there was no need or no
+// free page.
+int
+kzero_idle(void)
+{
+    struct kcpu *c;
+    struct run *r;
+
+    push_off();
+    c = &kmem.cpu[cpuid()];
+    pop_off();
+    // the scheduler never moves to another CPU, so c stays ours.
+    if(c->nzeroed >= NZEROED)
+        return 0;
+    acquire(&c->lock);
+    if((r = c->freelist) != 0){
+        c->freelist = r->next;
+        c->n--;
+    }
+    release(&c->lock);
+    if(r == 0){
+        acquire(&kmem.lock);
+        r = buddy_alloc(0);
+        release(&kmem.lock);
+        if(r == 0)
+            return 0;
+    }
+    alloc_fill(r);
+    kmem.ref[PA2REF(r)] = 1;
+    memset(r, 0, PGSIZE);
+    acquire(&c->lock);
+    r->next = c->zeroed;
+    c->zeroed = r;
+    c->nzeroed++;
+    release(&c->lock);
+    return 1;
+}
+
+// Return the number of pages free in the buddy allocator.
+// Caller holds kmem.lock.
+static uint64
+nfree(void)
+{
+    uint64 n = 0;
+
+    for(int k = 0; k <= MAXORDER; k++)
+        n += kmem.nfree[k] << k;
+    return n;
+}
+
+// Give every CPU's list, and its zeroed pool too if zeroed is
+// set, back to the buddy allocator, then try again to allocate
+// a block of 2^order pages. Returns 0 if there is still none.
+static void *
+drain_alloc(int order, int zeroed)
+{
+    void *pa;
+
+    for(int i = 0; i < NCPU; i++){
+        if(zeroed)
+            drain_zeroed(&kmem.cpu[i]);
+        else
+            drain(&kmem.cpu[i], KCACHE);
+    }
+    acquire(&kmem.lock);
+    pa = buddy_alloc(order);
+    release(&kmem.lock);
+    return pa;
+}
+
+// Allocate 2^order pages of physically contiguous memory,
+// aligned to their size, with one reference on each page, so
+// that the pages may later be freed one at a time with kfree()
+// or all at once with kfree_order(). Order 0 is kalloc().
+// Returns 0 if no block that large is free.
+void *
+kalloc_order(int order)
+{
+    void *pa;
+    uint64 free = 0, cached = 0, zeroed = 0;
+
+    if(order < 0 || order > MAXORDER)
+        panic("kalloc_order");
+    if(order == 0)
+        return kalloc();
+    acquire(&kmem.lock);
+    if((pa = buddy_alloc(order)) == 0)
+        free = nfree();
+    release(&kmem.lock);
+    if(pa == 0 && ticks >= kmem.nextdrain){
+        // pages cached by the CPUs may complete a block, if
+        // there are enough of them. zeroed pages are given up
+        // only if nothing else can, since they would have to be
+        // zeroed again.
+        for(int i = 0; i < NCPU; i++){
+            cached += kmem.cpu[i].n;
+            zeroed += kmem.cpu[i].nzeroed;
+        }
+        if(free + cached >= (1 << order))
+            pa = drain_alloc(order, 0);
+        if(pa == 0 && free + cached + zeroed >= (1 << order))
+            pa = drain_alloc(order, 1);
+        if(pa == 0)
+            kmem.nextdrain = ticks + DRAINGAP;
+    }
+    if(pa == 0){
+        acquire(&kmem.lock);
+        kmem.failed[order]++;
+        release(&kmem.lock);
+    }
+    if(pa){
+        for(int i = 0; i < (1 << order); i++){
+            alloc_fill((char*)pa + i*PGSIZE);
+            kmem.ref[PA2REF(pa) + i] = 1;
+        }
+    }
+    return pa;
+}
+
+// Drop a reference to each page of the block of 2^order pages
+// at pa, and free the pages that have no more left straight to
+// the buddy allocator, where they merge back into the block once
+// all of it is free.
+void
+kfree_order(void *pa, int order)
+{
+    int n;
+
+    if(order == 0){
+        kfree(pa);
+        return;
+    }
+    if(order > MAXORDER || ((uint64)pa % ((uint64)PGSIZE << order)) != 0 ||
+       (char*)pa < end || (uint64)pa >= PHYSTOP)
+        panic("kfree_order");
+    acquire(&kmem.lock);
+    for(int i = 0; i < (1 << order); i++){
+        if((n = __sync_sub_and_fetch(&kmem.ref[PA2REF(pa) + i], 1)) < 0)
+            panic("kfree_order: ref");
+        if(n == 0){
+            free_fill((char*)pa + i*PGSIZE);
+            buddy_free((char*)pa + i*PGSIZE, 0);
+        }
+    }
+    release(&kmem.lock);
+}
+
+// Add a reference to each page of the block of 2^order pages at pa.
+void
+kaddref_order(void *pa, int order)
+{
+    for(int i = 0; i < (1 << order); i++)
+        kaddref((char*)pa + i*PGSIZE);
+}
+
+// Copy out the free memory counters.
+void
+kmemstat(struct kmemstat *st)
+{
+    acquire(&kmem.lock);
+    for(int k = 0; k <= MAXORDER; k++){
+        st->nfree[k] = kmem.nfree[k];
+        st->failed[k] = kmem.failed[k];
+    }
+    release(&kmem.lock);
+    st->cached = st->zeroed = 0;
+    for(int i = 0; i < NCPU; i++){
+        st->cached += kmem.cpu[i].n;
+        st->zeroed += kmem.cpu[i].nzeroed;
+    }
+    st->zero_hits = kmem.zero_hits;
+    st->zero_misses = kmem.zero_misses;
+}
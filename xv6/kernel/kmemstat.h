@@ -0,0 +1,10 @@
+// physical memory counters, read with kmemstat().
+// a free block of order k is 2^k contiguous pages.
+struct kmemstat {
+  uint64 nfree[MAXORDER+1];   // free blocks of each order
+  uint64 failed[MAXORDER+1];  // allocations of each order that found none
+  uint64 cached;              // free pages held by the per-CPU lists
+  uint64 zeroed;              // pages zeroed ahead for kalloc_zeroed()
+  uint64 zero_hits;           // kalloc_zeroed() calls that got one
+  uint64 zero_misses;         // and those that cleared a page themselves
+};
@@ -17,6 +17,7 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // small object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
@@ -27,8 +28,12 @@ main()
     binit();         // buffer cache
     iinit();         // inode cache
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    vmainit();       // mmap region table
+    pcacheinit();    // mmap page cache
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    kthread(vma_flusher, "msyncd"); // msync(MS_ASYNC) writer
     __sync_synchronize();
     started = 1;
   } else {
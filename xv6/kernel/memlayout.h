@@ -62,6 +62,10 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap regions (MMAPBASE up to TRAPFRAME)
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// mmap() places mappings between MMAPBASE and TRAPFRAME.
+#define MMAPBASE (TRAPFRAME - 16*1024*PGSIZE)
@@ -0,0 +1,12 @@
+// mp2: mmap paging counters, read with mmapstat().
+// times are in r_time() units.
+struct mmapstat {
+  uint64 faults;        // page faults taken on mmap regions
+  uint64 mapped;        // pages mapped by those faults, fault-around included
+  uint64 fault_time;    // time spent handling them
+  uint64 populated;     // pages mapped up front by MAP_POPULATE
+  uint64 populate_time; // time spent doing that
+  uint64 megapages;     // 2MB megapages mapped, by faults or up front
+  uint64 misses;        // page cache misses, each read from disk
+  uint64 uncached;      // of those, pages the full page cache could not keep
+};
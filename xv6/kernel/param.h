@@ -1,13 +1,17 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define RAMAX        8  // max readahead window, in blocks
+#define NBUF         (MAXOPBLOCKS*3+2*RAMAX)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NVMA         16    // mmap regions per process
+#define NPCACHE      512   // pages in the mmap page cache
+#define FAULTAROUND  16    // default pages mapped around an mmap fault
+#define MAXORDER     10    // largest physical block is 2^MAXORDER pages
@@ -0,0 +1,235 @@
+//
+// mp2: page cache for mmap.
+//
+// Caches whole pages of file data, keyed by (inode, page index),
+// in reference-counted physical frames. Every MAP_SHARED fault
+// on the same file page maps the same frame, so processes that
+// share a mapping really share memory, and MAP_PRIVATE faults
+// copy from the cached frame instead of going back to disk.
+//
+// Interface:
+// * pcache_get() returns the frame for a file page, reading it
+//   on a miss, with a reference the caller drops with kfree().
+//   a frame that could not be cached is only handed out for a
+//   private copy, since a shared mapping of it would not be
+//   shared, nor kept in step with write().
+// * pcache_peek() is the same but only for pages already cached.
+// * writei() calls pcache_update() so cached pages follow write().
+// * pcache_drop() forgets an inode's pages; iput() calls it when
+//   the last reference goes and itrunc() when the data goes.
+//
+// An entry whose frame holds only the cache's own reference is
+// not mapped anywhere and may be recycled for another page.
+// Callers of pcache_get() hold the inode lock, which keeps two
+// processes from filling the same page at once; pcache.lock only
+// protects the table itself.
+//
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "defs.h"
+#include "fs.h"
+#include "readahead.h"
+#include "file.h"
+#include "mmapstat.h"
+
+#define NPCHASH 61
+
+struct page {
+    struct inode *ip;     // owning inode, 0 if unused
+    uint pgoff;           // page index within the file
+    char *pa;             // frame; the cache holds one reference
+    struct page *hnext;   // hash chain
+    struct page *prev;    // LRU list
+    struct page *next;
+};
+
+struct {
+    struct spinlock lock;
+    struct page page[NPCACHE];
+    struct page *hash[NPCHASH];
+
+    // Linked list of all entries, through prev/next.
+    // head.next is most recently used, head.prev is least.
+    struct page head;
+} pcache;
+
+void
+pcacheinit(void)
+{
+    struct page *pg;
+
+    initlock(&pcache.lock, "pcache");
+    pcache.head.prev = &pcache.head;
+    pcache.head.next = &pcache.head;
+    for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+        pg->next = pcache.head.next;
+        pg->prev = &pcache.head;
+        pcache.head.next->prev = pg;
+        pcache.head.next = pg;
+    }
+}
+
+static struct page**
+bucket(struct inode *ip, uint pgoff)
+{
+    return &pcache.hash[(ip->inum * 31 + pgoff) % NPCHASH];
+}
+
+// Find the entry for (ip, pgoff). Caller holds pcache.lock.
+static struct page*
+lookup(struct inode *ip, uint pgoff)
+{
+    struct page *pg;
+
+    for(pg = *bucket(ip, pgoff); pg; pg = pg->hnext)
+        if(pg->ip == ip && pg->pgoff == pgoff)
+            return pg;
+    return 0;
+}
+
+static void
+unhash(struct page *pg)
+{
+    struct page **pp;
+
+    for(pp = bucket(pg->ip, pg->pgoff); *pp != pg; pp = &(*pp)->hnext)
+        ;
+    *pp = pg->hnext;
+    pg->ip->cached--;
+    pg->ip = 0;
+}
+
+// Move pg to the most-recently-used end of the list.
+static void
+touch(struct page *pg)
+{
+    pg->next->prev = pg->prev;
+    pg->prev->next = pg->next;
+    pg->next = pcache.head.next;
+    pg->prev = &pcache.head;
+    pcache.head.next->prev = pg;
+    pcache.head.next = pg;
+}
+
+// Return the frame holding page pgoff of ip, reading it from
+// disk on a miss straight into a new frame with readpage().
+// Bytes past the end of the file read as zero.
+// The caller gets its own reference to the frame.
+// If every entry is mapped somewhere, the page cannot be cached;
+// it is still returned if private is set, since the caller only
+// wants a copy of the data, and otherwise 0 is.
+// Returns 0 if out of memory too.
+// Caller must hold ip->lock.
+char*
+pcache_get(struct inode *ip, uint pgoff, int private)
+{
+    struct page *pg;
+    char *mem, *old;
+
+    acquire(&pcache.lock);
+    if((pg = lookup(ip, pgoff)) != 0){
+        touch(pg);
+        mem = pg->pa;
+        kaddref(mem);
+        release(&pcache.lock);
+        return mem;
+    }
+    release(&pcache.lock);
+
+    if((mem = kalloc()) == 0)
+        return 0;
+    readpage(ip, pgoff, mem);
+    __sync_fetch_and_add(&mmstat.misses, 1);
+
+    // recycle the least recently used entry nobody maps.
+    acquire(&pcache.lock);
+    for(pg = pcache.head.prev; pg != &pcache.head; pg = pg->prev)
+        if(pg->ip == 0 || krefcount(pg->pa) == 1)
+            break;
+    if(pg == &pcache.head){
+        release(&pcache.lock);
+        __sync_fetch_and_add(&mmstat.uncached, 1);
+        if(private)
+            return mem;
+        kfree(mem);
+        return 0;
+    }
+    old = 0;
+    if(pg->ip){
+        unhash(pg);
+        old = pg->pa;
+    }
+    pg->ip = ip;
+    pg->pgoff = pgoff;
+    pg->pa = mem;
+    pg->hnext = *bucket(ip, pgoff);
+    *bucket(ip, pgoff) = pg;
+    ip->cached++;
+    touch(pg);
+    kaddref(mem);
+    release(&pcache.lock);
+
+    if(old)
+        kfree(old);
+    return mem;
+}
+
+// Return the frame caching page pgoff of ip with a reference for
+// the caller, or 0 if the page is not cached. Never reads the disk,
+// so the inode need not be locked.
+char*
+pcache_peek(struct inode *ip, uint pgoff)
+{
+    struct page *pg;
+    char *pa = 0;
+
+    if(ip->cached == 0)
+        return 0;
+    acquire(&pcache.lock);
+    if((pg = lookup(ip, pgoff)) != 0){
+        pa = pg->pa;
+        kaddref(pa);
+    }
+    release(&pcache.lock);
+    return pa;
+}
+
+// writei() wrote n bytes at off from src; update the cached copy.
+// The range must not cross a page boundary.
+// Caller must hold ip->lock.
+void
+pcache_update(struct inode *ip, uint off, void *src, uint n)
+{
+    struct page *pg;
+
+    if(ip->cached == 0)
+        return;
+    acquire(&pcache.lock);
+    if((pg = lookup(ip, off / PGSIZE)) != 0)
+        memmove(pg->pa + off % PGSIZE, src, n);
+    release(&pcache.lock);
+}
+
+// Forget every cached page of ip. Frames still mapped by some
+// process stay alive until they are unmapped.
+void
+pcache_drop(struct inode *ip)
+{
+    struct page *pg;
+
+    if(ip->cached == 0)
+        return;
+    acquire(&pcache.lock);
+    for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+        if(pg->ip == ip){
+            unhash(pg);
+            kfree(pg->pa);
+            pg->pa = 0;
+        }
+    }
+    release(&pcache.lock);
+}
@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "readahead.h"
 #include "proc.h"
 #include "fcntl.h"
 #include "defs.h"
@@ -20,6 +21,7 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void wakeup1(struct proc *chan);
 static void freeproc(struct proc *p);
 
@@ -160,6 +162,8 @@ freeproc(struct proc *p)
     p->chan = 0;
     p->killed = 0;
     p->xstate = 0;
+    p->nvma = 0;
+    p->kthread = 0;
     p->state = UNUSED;
 }
 
@@ -244,19 +248,37 @@ userinit(void)
     release(&p->lock);
 }
 
+// Create a process that runs fn() in the kernel and never
+// returns to user space, such as a background writer.
+void
+kthread(void (*fn)(void), char *name)
+{
+    struct proc *p;
+
+    if((p = allocproc()) == 0)
+        panic("kthread");
+    p->kthread = fn;
+    p->context.ra = (uint64)kthreadret;
+    safestrcpy(p->name, name, sizeof(p->name));
+    p->state = RUNNABLE;
+    release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-    uint sz;
+    uint64 sz;
     struct proc *p = myproc();
 
     sz = p->sz;
     if(n > 0){
-        if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+        // the heap may not grow into an mmap region. its pages
+        // are allocated when first touched, by page_fault().
+        if(sz + n > TRAPFRAME || vma_overlap(p, sz, sz + n) != 0)
             return -1;
-        }
+        sz += n;
     } else if(n < 0){
         sz = uvmdealloc(p->pagetable, sz, sz + n);
     }
@@ -286,6 +308,14 @@ fork(void)
     }
     np->sz = p->sz;
 
+    // mp2
+    if(vma_fork(p, np) < 0){
+        vma_free_all(np);
+        freeproc(np);
+        release(&np->lock);
+        return -1;
+    }
+
     np->parent = p;
 
     // copy saved user registers.
@@ -306,53 +336,6 @@ fork(void)
 
     np->state = RUNNABLE;
 
-    // mp2
-    struct vma *VMA, *nVMA;
-    struct vm_block *nblocks, *blocks;
-    int offset = 0, pte_per = 0;
-    for(int i = 0; i < 16; i++){
-        VMA = p->vmas+i;
-        nVMA = np->vmas+i;
-        *nVMA = *VMA;
-        if(VMA->vm_head != 0){
-            // maintain property of pointer
-            offset = VMA->vm_head - VMA->vm_blocks;
-            nVMA->vm_head = nVMA->vm_blocks + offset;
-        }
-        if(VMA->vm_head != 0)
-            nVMA->vm_file = filedup(VMA->vm_file);
-        blocks = VMA->vm_blocks;
-        nblocks = nVMA->vm_blocks;
-        if(VMA->vm_prot & PROT_READ)
-            pte_per |= PTE_R;
-        if(VMA->vm_prot & PROT_WRITE)
-            pte_per |= PTE_W;
-        pte_per |= (PTE_U | PTE_V);
-
-        char *tmp = kalloc();
-        uint64 va, pa;
-        for(int j = 0; j < mmap_MAXPAGE; j++){
-            nblocks[j] = blocks[j]; 
-            if(blocks[j].next != 0){
-
-                // maintain property of pointer
-                offset = blocks[j].next - blocks;
-                nblocks[j].next = nblocks+offset;
-                
-                // copy the content to child
-                // since the content should be same at fork() being called
-                va = blocks[j].next->addr;
-                if( (pa = walkaddr(p->pagetable, va)) != 0 &&
-                    VMA->vm_flags & MAP_PRIVATE){
-                    uvmalloc_prot(np->pagetable, va, va+PGSIZE, pte_per);
-                    copyin(p->pagetable, tmp, va, PGSIZE);
-                    copyout(np->pagetable, va, tmp, PGSIZE);
-                }
-            }
-        }
-        kfree(tmp);
-    }
-
     release(&np->lock);
 
     return pid;
@@ -397,35 +380,8 @@ exit(int status)
 
     // munmap
     // free all visible resources
-    struct vma *VMA;
-    struct vm_block *ptr, *next;
-    uint64 old_offset;
-
-    for(int i = 0; i < 16;i ++){
-        if(p->vmas[i].vm_head != 0){
-            VMA = p->vmas+i;
-            ptr = VMA->vm_head;        
-            while(ptr->next != 0){
-                next = ptr->next;
-
-                old_offset = VMA->vm_file->off;
-                VMA->vm_file->off = (next->offset);
-                writepage(VMA, VMA->vm_file, next->addr, PGSIZE);
-                VMA->vm_file->off = old_offset;
-                // ensure that the address is mapped
-                // otherwise it'll raise unmap error
-                if(walkaddr(p->pagetable, next->addr) != 0)
-                    uvmunmap(p->pagetable, next->addr, 1, 1);
-                // maintain linked list
-                next->addr = 0;
-                ptr->next = 0;
-                ptr = next;
-            }
-            VMA->vm_head->addr = 0;
-            VMA->vm_head = 0;
-            fileclose(VMA->vm_file);
-        }
-    }
+    vma_unmap_all(p);
+
     // Close all open files.
     for(int fd = 0; fd < NOFILE; fd++){
         if(p->ofile[fd]){
@@ -553,13 +509,11 @@ scheduler(void)
         // Avoid deadlock by ensuring that devices can interrupt.
         intr_on();
         
-        int nproc = 0;
+        int found = 0;
         for(p = proc; p < &proc[NPROC]; p++) {
             acquire(&p->lock);
-            if(p->state != UNUSED) {
-                nproc++;
-            }
             if(p->state == RUNNABLE) {
+                found = 1;
                 // Switch to chosen process.    It is the process's job
                 // to release its lock and then reacquire it
                 // before jumping back to us.
@@ -573,9 +527,12 @@ scheduler(void)
             }
             release(&p->lock);
         }
-        if(nproc <= 2) {     // only init and sh exist
+        if(found == 0) {     // nothing to run
             intr_on();
-            asm volatile("wfi");
+            // zero pages ahead for kalloc_zeroed(), looking for
+            // work again after each; sleep once there is none.
+            if(kzero_idle() == 0)
+                asm volatile("wfi");
         }
     }
 }
@@ -639,6 +596,20 @@ forkret(void)
     usertrapret();
 }
 
+// A kernel-only process's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+    struct proc *p = myproc();
+
+    // Still holding p->lock from scheduler.
+    release(&p->lock);
+
+    p->kthread();
+    panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -784,9 +755,10 @@ procdump(void)
     }
 }
 
-// write a page back to file
-int writepage(struct vma *VMA, struct file *f, uint64 addr, int n){
-    int r = 0;
+// write n bytes at user address addr back to file f at offset
+// off, leaving f->off alone. only data the file already has is
+// rewritten; a shared mapping never extends its file.
+int writepage(struct vma *VMA, struct file *f, uint64 addr, uint off, int n){
     if((VMA->vm_flags & MAP_PRIVATE) || 
            !(VMA->vm_prot & PROT_WRITE) )
         return -1;
@@ -794,22 +766,5 @@ int writepage(struct vma *VMA, struct file *f, uint64 addr, int n){
     if(f->writable == 0)
         return -1;
 
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-        int n1 = n - i;
-        if(n1 > max)
-            n1 = max;
-
-        begin_op();
-        ilock(f->ip);
-        if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-            f->off += r;
-        iunlock(f->ip);
-        end_op();
-        if(r <= 0)
-            break;
-        i += r;
-    }
-    return 0;
+    return ipwrite(f->ip, 1, addr, off, n, 0) < 0 ? -1 : 0;
 }
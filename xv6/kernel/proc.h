@@ -83,25 +83,24 @@ struct trapframe {
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 // mp2, VMA
 //
-// in case of non successive mmap memory
-// adopt linked list to implement simply
-// will be quite slow if the mapping region is large
-#define mmap_MAXPAGE 1024
-struct vm_block{
-    // each struct vm_block refer to one page
-    uint64 addr;
-    off_t offset;
-    struct vm_block *next;
-};
+// each vma describes one contiguous range of mapped pages,
+// [vm_start, vm_end), backed by vm_file from byte vm_pgoff on.
+// vmas come from a slab cache (see vma.c) and are only
+// allocated by mmap. p->vmas[0..nvma) points at the ones a
+// process owns, sorted by vm_start; the ranges never overlap,
+// so the vma owning an address is found by binary search and
+// the file offset of a page is computed, not stored.
 struct vma{
-    struct vm_block vm_blocks[mmap_MAXPAGE];
-    struct vm_block *vm_head; // the initial value of vm_head->addr is 0,
-                              // which indicate that this vma has not been used
-    uint64 vm_length;
+    uint64 vm_start;
+    uint64 vm_end;
     int vm_flags;
     int vm_prot;
     struct file *vm_file;
-    uint64 vm_pgoff;
+    uint64 vm_pgoff;          // file offset of vm_start
+    int vm_fault_around;      // cached pages mapped around a fault
+    int vm_advice;            // MADV_NORMAL, _RANDOM or _SEQUENTIAL
+    int vm_nohuge;            // MADV_NOHUGEPAGE: no megapages here
+    struct ra_state vm_ra;    // readahead for faults on this region
 };
 // Per-process state
 struct proc {
@@ -124,5 +123,7 @@ struct proc {
     struct file *ofile[NOFILE];    // Open files
     struct inode *cwd;                     // Current directory
     char name[16];                             // Process name (debugging)
-    struct vma vmas[16];
+    struct vma *vmas[NVMA];          // mapped regions, sorted by vm_start
+    int nvma;                                      // number of entries in vmas
+    void (*kthread)(void);              // entry point of a kernel-only process
 };
@@ -0,0 +1,7 @@
+// Sequential readahead state, one per open file and one per
+// mmap region; see readahead() in fs.c.
+struct ra_state {
+  uint end;    // offset just past the last read
+  uint ahead;  // prefetches have been issued up to here
+  uint win;    // window in blocks, 0 while access looks random
+};
@@ -331,6 +331,9 @@ sfence_vma()
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
+#define PTE_A (1L << 6) // set by hardware when the page is accessed
+#define PTE_D (1L << 7) // set by hardware when the page is written
+#define PTE_COW (1L << 8) // copy-on-write; uses a bit reserved for software
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -344,6 +347,18 @@ sfence_vma()
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
 #define PX(level, va) ((((uint64) (va)) >> PXSHIFT(level)) & PXMASK)
 
+// a megapage is mapped by a leaf PTE in a level-1 page table,
+// in place of a whole leaf page table of 512 pages.
+#define MEGASIZE (1L << PXSHIFT(1))
+#define MEGAORDER (PXSHIFT(1) - PGSHIFT)   // log2 of pages per megapage
+#define MEGAROUNDDOWN(a) (((uint64) (a)) & ~(MEGASIZE-1))
+
+// the last page that shares va's leaf page table.
+#define PXLAST(va) PGROUNDDOWN(((uint64) (va)) | (MEGASIZE - 1))
+
+// does a valid PTE map memory, rather than point to a page table?
+#define PTE_LEAF(pte) ((pte) & (PTE_R|PTE_W|PTE_X))
+
 // one beyond the highest possible virtual address.
 // MAXVA is actually one bit less than the max allowed by
 // Sv39, to avoid having to sign-extend virtual addresses
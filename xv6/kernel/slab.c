@@ -0,0 +1,226 @@
+//
+// Slab allocator for small kernel objects.
+//
+// A cache hands out objects of one size, carved from pages that
+// kalloc() provides. Each slab is one page with a struct slab at
+// its start and as many objects as fit after it, so the slab of
+// an object is found by rounding its address down to a page.
+// An object's constructor runs once, when its slab is made, and
+// objects come back to the cache still constructed, so state
+// such as a lock is not set up again on every allocation. Which
+// objects are free is kept in a bitmap in the slab header rather
+// than in the objects themselves, for the same reason.
+//
+// Each CPU keeps a magazine of free objects for every cache,
+// used with interrupts off and without a lock. Only when a
+// magazine runs empty or full is the cache's lock taken, to move
+// half a magazine's worth from or to the slabs.
+//
+// Interface:
+// * kmem_cache_create() makes a cache, at boot.
+// * kmem_cache_alloc() returns an object, or 0 if out of memory.
+// * kmem_cache_free() gives one back.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NCACHE 8
+#define MAGSIZE 16
+#define MAXPERSLAB 256
+
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *next;          // partial list
+    struct slab *prev;
+    int inuse;                  // objects handed out or in magazines
+    uint64 free[MAXPERSLAB/64]; // bit i set if object i is free
+};
+
+struct kmag {
+    int n;
+    void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+    struct spinlock lock;
+    char *name;
+    uint size;
+    int perslab;
+    void (*ctor)(void*);
+    struct slab *partial;   // slabs with both free and used objects
+    struct slab *empty;     // a slab with none used, kept for reuse
+    struct kmag mag[NCPU];
+};
+
+struct {
+    struct spinlock lock;
+    struct kmem_cache cache[NCACHE];
+    int n;
+} slabs;
+
+#define OBJ(s, i) ((char*)(s) + sizeof(struct slab) + (i)*(s)->cache->size)
+
+// Make a cache of objects of size bytes. ctor, if not 0, is
+// called on every object once before it is first handed out.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size, void (*ctor)(void*))
+{
+    struct kmem_cache *c;
+
+    size = (size + 7) & ~7;
+    if(size == 0 || size > PGSIZE - sizeof(struct slab))
+        panic("kmem_cache_create: size");
+    acquire(&slabs.lock);
+    if(slabs.n == NCACHE)
+        panic("kmem_cache_create: too many");
+    c = &slabs.cache[slabs.n++];
+    release(&slabs.lock);
+
+    memset(c, 0, sizeof(*c));
+    initlock(&c->lock, name);
+    c->name = name;
+    c->size = size;
+    c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+    if(c->perslab > MAXPERSLAB)
+        c->perslab = MAXPERSLAB;
+    c->ctor = ctor;
+    return c;
+}
+
+void
+slabinit(void)
+{
+    initlock(&slabs.lock, "slabs");
+}
+
+static void
+partial_add(struct kmem_cache *c, struct slab *s)
+{
+    s->prev = 0;
+    s->next = c->partial;
+    if(s->next)
+        s->next->prev = s;
+    c->partial = s;
+}
+
+static void
+partial_remove(struct kmem_cache *c, struct slab *s)
+{
+    if(s->prev)
+        s->prev->next = s->next;
+    else
+        c->partial = s->next;
+    if(s->next)
+        s->next->prev = s->prev;
+}
+
+// Make a slab of constructed, free objects for c.
+// Caller holds c->lock.
+static struct slab*
+slab_new(struct kmem_cache *c)
+{
+    struct slab *s;
+
+    if((s = (struct slab*)kalloc()) == 0)
+        return 0;
+    memset(s, 0, sizeof(*s));
+    s->cache = c;
+    for(int i = 0; i < c->perslab; i++){
+        s->free[i/64] |= 1L << (i%64);
+        if(c->ctor)
+            c->ctor(OBJ(s, i));
+    }
+    return s;
+}
+
+// Take a free object from c's slabs, making a slab if none has
+// one. Returns 0 if out of memory. Caller holds c->lock.
+static void*
+slab_get(struct kmem_cache *c)
+{
+    struct slab *s;
+    int i, w;
+
+    if((s = c->partial) == 0){
+        if((s = c->empty) != 0)
+            c->empty = 0;
+        else if((s = slab_new(c)) == 0)
+            return 0;
+        partial_add(c, s);
+    }
+    for(w = 0; s->free[w] == 0; w++)
+        ;
+    i = w*64 + __builtin_ctzl(s->free[w]);
+    s->free[w] &= ~(1L << (i%64));
+    if(++s->inuse == c->perslab)
+        partial_remove(c, s);
+    return OBJ(s, i);
+}
+
+// Give obj back to its slab. A slab left with nothing in use
+// is kept if c has no other such, else its page is freed.
+// Caller holds c->lock.
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+    struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+    int i = ((char*)obj - OBJ(s, 0)) / c->size;
+
+    if(s->cache != c || OBJ(s, i) != obj || (s->free[i/64] & (1L << (i%64))))
+        panic("kmem_cache_free");
+    s->free[i/64] |= 1L << (i%64);
+    if(s->inuse-- == c->perslab)
+        partial_add(c, s);
+    if(s->inuse > 0)
+        return;
+    partial_remove(c, s);
+    if(c->empty == 0)
+        c->empty = s;
+    else
+        kfree(s);
+}
+
+// Allocate an object from c. It is as its constructor left it,
+// or as the last kmem_cache_free() of it did.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+    struct kmag *m;
+    void *obj;
+
+    push_off();
+    m = &c->mag[cpuid()];
+    if(m->n == 0){
+        acquire(&c->lock);
+        while(m->n < MAGSIZE/2 && (obj = slab_get(c)) != 0)
+            m->obj[m->n++] = obj;
+        release(&c->lock);
+    }
+    obj = m->n > 0 ? m->obj[--m->n] : 0;
+    pop_off();
+    return obj;
+}
+
+// Give obj, from kmem_cache_alloc(c), back to c. Anything its
+// constructor set up must be as the constructor left it.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+    struct kmag *m;
+
+    push_off();
+    m = &c->mag[cpuid()];
+    if(m->n == MAGSIZE){
+        acquire(&c->lock);
+        while(m->n > MAGSIZE/2)
+            slab_put(c, m->obj[--m->n]);
+        release(&c->lock);
+    }
+    m->obj[m->n++] = obj;
+    pop_off();
+}
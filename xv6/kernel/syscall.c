@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "readahead.h"
 #include "proc.h"
 #include "syscall.h"
 #include "defs.h"
@@ -107,6 +108,17 @@ extern uint64 sys_uptime(void);
 extern uint64 sys_mmap(void);
 extern uint64 sys_munmap(void);
 extern uint64 sys_vmprint(void);
+extern uint64 sys_msync(void);
+extern uint64 sys_faultaround(void);
+extern uint64 sys_mmapstat(void);
+extern uint64 sys_madvise(void);
+extern uint64 sys_mprotect(void);
+extern uint64 sys_mremap(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_kmemstat(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -132,7 +144,18 @@ static uint64 (*syscalls[])(void) = {
 [SYS_close]   sys_close,
 [SYS_mmap]    sys_mmap,
 [SYS_munmap]  sys_munmap,
-[SYS_vmprint] sys_vmprint
+[SYS_vmprint] sys_vmprint,
+[SYS_msync]   sys_msync,
+[SYS_faultaround] sys_faultaround,
+[SYS_mmapstat] sys_mmapstat,
+[SYS_madvise] sys_madvise,
+[SYS_mprotect] sys_mprotect,
+[SYS_mremap] sys_mremap,
+[SYS_pread]  sys_pread,
+[SYS_pwrite] sys_pwrite,
+[SYS_readv]  sys_readv,
+[SYS_writev] sys_writev,
+[SYS_kmemstat] sys_kmemstat,
 };
 
 void
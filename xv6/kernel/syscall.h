@@ -24,3 +24,14 @@
 #define SYS_mmap   22
 #define SYS_munmap 23
 #define SYS_vmprint 24
+#define SYS_msync  25
+#define SYS_faultaround 26
+#define SYS_mmapstat 27
+#define SYS_madvise 28
+#define SYS_mprotect 29
+#define SYS_mremap 30
+#define SYS_pread  31
+#define SYS_pwrite 32
+#define SYS_readv  33
+#define SYS_writev 34
+#define SYS_kmemstat 35
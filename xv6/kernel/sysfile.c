@@ -10,11 +10,13 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "readahead.h"
 #include "proc.h"
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "uio.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -91,6 +93,130 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// read or write at offset off, leaving the file's own offset
+// alone, so that processes sharing an open file need not agree
+// on where it is.
+uint64
+sys_pread(void)
+{
+  struct file *f;
+  int n;
+  uint64 p, off;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0 ||
+     argaddr(3, &off) < 0)
+    return -1;
+  if(f->type != FD_INODE || f->readable == 0 || n < 0 || off > 0xffffffffUL)
+    return -1;
+  prefault(p, n, 1);
+  return ipread(f->ip, 1, p, off, n);
+}
+
+uint64
+sys_pwrite(void)
+{
+  struct file *f;
+  int n;
+  uint64 p, off;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0 ||
+     argaddr(3, &off) < 0)
+    return -1;
+  if(f->type != FD_INODE || f->writable == 0 || n < 0 || off > 0xffffffffUL)
+    return -1;
+  prefault(p, n, 0);
+  return ipwrite(f->ip, 1, p, off, n, 1);
+}
+
+// Fetch the iovec array that is the nth system call argument,
+// with its length as argument n+1, into iov.
+// Returns the total length of its pieces, or -1.
+static int
+argiov(int n, struct iovec *iov, int *cnt)
+{
+  uint64 uiov;
+  uint64 tot = 0;
+  int i;
+
+  if(argaddr(n, &uiov) < 0 || argint(n+1, cnt) < 0)
+    return -1;
+  if(*cnt < 0 || *cnt > IOV_MAX)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)iov, uiov, *cnt * sizeof(iov[0])) < 0)
+    return -1;
+  for(i = 0; i < *cnt; i++){
+    if(iov[i].iov_len > 0x7fffffff - tot)
+      return -1;
+    tot += iov[i].iov_len;
+  }
+  return tot;
+}
+
+// read into each piece of the iovec array in turn, stopping
+// early at the end of the file.
+uint64
+sys_readv(void)
+{
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int cnt, i, r, tot = 0;
+
+  if(argfd(0, 0, &f) < 0 || argiov(1, iov, &cnt) < 0)
+    return -1;
+  for(i = 0; i < cnt; i++){
+    r = fileread(f, (uint64)iov[i].iov_base, iov[i].iov_len);
+    if(r < 0)
+      return tot > 0 ? tot : -1;
+    tot += r;
+    if(r < iov[i].iov_len)
+      break;
+  }
+  return tot;
+}
+
+// write each piece of the iovec array in turn. if the file is
+// an inode and all of it fits in one log transaction, it goes
+// in one, so a crash keeps all of it or none. if a piece fails,
+// returns the bytes written before it, or -1 if there were none.
+uint64
+sys_writev(void)
+{
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int cnt, i, r, tot, n = 0;
+
+  if(argfd(0, 0, &f) < 0 || (tot = argiov(1, iov, &cnt)) < 0)
+    return -1;
+  if(f->writable == 0)
+    return -1;
+
+  if(f->type == FD_INODE && tot <= ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE){
+    for(i = 0; i < cnt; i++)
+      prefault((uint64)iov[i].iov_base, iov[i].iov_len, 0);
+    begin_op();
+    ilock(f->ip);
+    for(i = 0; i < cnt; i++){
+      r = writei(f->ip, 1, (uint64)iov[i].iov_base, f->off, iov[i].iov_len);
+      if(r > 0){
+        f->off += r;
+        n += r;
+      }
+      if(r != iov[i].iov_len)
+        break;
+    }
+    iunlock(f->ip);
+    end_op();
+    return i < cnt && n == 0 ? -1 : n;
+  }
+
+  for(i = 0; i < cnt; i++){
+    if(filewrite(f, (uint64)iov[i].iov_base, iov[i].iov_len) != iov[i].iov_len)
+      return n > 0 ? n : -1;
+    n += iov[i].iov_len;
+  }
+  return n;
+}
+
 uint64
 sys_close(void)
 {
@@ -6,11 +6,14 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "readahead.h"
 #include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
 #include "stat.h"
+#include "mmapstat.h"
+#include "kmemstat.h"
 
 uint64
 sys_exit(void)
@@ -46,7 +49,7 @@ sys_wait(void)
 uint64
 sys_sbrk(void)
 {
-    int addr;
+    uint64 addr;
     int n;
 
     if(argint(0, &n) < 0)
@@ -107,41 +110,33 @@ sys_uptime(void)
 // Some code block is comment out because it should be 
 // implemented at trap.c
 
-static int findVMA(uint64 va, struct vma **VMA, struct vm_block **ptr){
-    struct proc *p = myproc();
-    struct vm_block *next;
-    for(int i = 0; i < 16; i++){
-        *ptr = p->vmas[i].vm_head; 
-        if(*ptr == 0)
-            continue;
-        while((*ptr)->next != 0){
-            next = (*ptr)->next;
-            if(next->addr == va){
-                *VMA = p->vmas+i;
-                return 1;
-            }
-            *ptr = next;
-        }
-    }
-    return 0;
-}
 uint64 sys_mmap(void){
     struct proc *p = myproc();
-    struct vm_addr *addr;
+    uint64 addr;
     size_t length;
     int prot;
     int flags;
     int fd;
     off_t offset;
-    argaddr(0, (uint64 *)&addr), argaddr(1, &length), argint(2, &prot),
+    argaddr(0, &addr), argaddr(1, &length), argint(2, &prot),
     argint(3, &flags), argint(4, &fd), argaddr(5, &offset);
 
-    struct file *f = p->ofile[fd];
-    if( addr != 0 ){
-    //    printf("addr should be 0\n");
-        goto bad;
+    struct file *f = 0;
+    if( flags & MAP_ANONYMOUS ){
+        // anonymous memory has no file behind it.
+        if( fd != -1 || offset != 0 )
+            goto bad;
+    } else {
+        if( fd < 0 || fd >= NOFILE ){
+        //    printf("invalid fd\n");
+            goto bad;
+        }
+        if( (f = p->ofile[fd]) == 0 ){
+        //    printf("invalid fd\n");
+            goto bad;
+        }
     }
-    if( length < 0 ){
+    if( length <= 0 ){
     //    printf("length should be greater than 0\n");
         goto bad;
     }
@@ -153,146 +148,282 @@ uint64 sys_mmap(void){
     //    printf("invalid flags\n");
         goto bad;
     }
-    if( f == 0){
-    //    printf("invalid fd\n");
-        goto bad;
-    }
-    if( f->type != FD_INODE ){
+    if( f && f->type != FD_INODE ){
     //    printf("invalid file\n");
         goto bad;
     }
-    if( offset != 0){
+    // file offsets are 32 bits wide.
+    if( offset % PGSIZE != 0 || offset > 0xffffffffUL ||
+        length > 0xffffffffUL - offset ){
     //    printf("invalid offset\n");
         goto bad;
     }
 
     // handle permission issue
-    if(prot & PROT_READ){
+    if(f && (prot & PROT_READ)){
         if(!(f->readable)){
     //        printf("file is not readable\n");
             goto bad;
         }
     }
-    if(prot & PROT_WRITE){
+    if(f && (prot & PROT_WRITE)){
         if(!(f->writable) && (flags & MAP_SHARED)){
     //        printf("file is not writable\n");
             goto bad;
         }
     }
 
-    struct vma *VMA = 0;
-    int i;
-    // find available vma
-    for(i = 0; i < 16; i++){
-        if(p->vmas[i].vm_head == 0){
-            VMA = p->vmas+i;
-            break;
-        }
+    // MAP_FIXED must get exactly addr, and replaces whatever is
+    // mapped there; any other addr is a hint, used if it is free,
+    // else the lowest free range is taken.
+    // pages are not allocated until mmap_allocate() handles the
+    // first fault on them.
+    length = PGROUNDUP(length);
+    uint64 start;
+    struct vma *VMA;
+    if(flags & MAP_FIXED){
+        if(!vma_inrange(p, addr, length) ||
+           vma_unmap_range(p, addr, addr + length) != 0)
+            goto bad;
+        start = addr;
+    } else if(addr != 0 && vma_fits(p, PGROUNDUP(addr), length)){
+        start = PGROUNDUP(addr);
+    } else {
+        start = vma_gap(p, length);
     }
-    if(VMA == 0){
+    if(start == 0 || (VMA = vma_insert(p, start, start + length)) == 0){
     //    printf("no vma left\n");
         goto bad;
     }
-    length = PGROUNDUP(length);
-    for(int i = 0; i < mmap_MAXPAGE; i++){
-        if(VMA->vm_blocks[i].addr == 0){
-            VMA->vm_head = VMA->vm_blocks+i;
-            VMA->vm_head->addr = 1;
-            break;
-        }
-    }
-    VMA->vm_file = f;
-    VMA->vm_length = length;
     VMA->vm_flags = flags;
     VMA->vm_prot = prot;
     VMA->vm_pgoff = offset;//offset within file
-    struct vm_block *ptr = VMA->vm_head, *nil;
-    struct vma *null;
-    int num_pages = length/PGSIZE;
-    int count = 0;
-    // assign address for each block,
-    // hasn't allocated yet
-    uint64 start = TRAMPOLINE - (mmap_MAXPAGE*16)*PGSIZE; 
-    uint64 va = start;
-    for(int i = 0; i < mmap_MAXPAGE && count < num_pages; i++){
-        if( VMA->vm_blocks[i].addr == 0){
-            for(; va < TRAMPOLINE; va += PGSIZE){
-                if(!(findVMA(va, &null, &nil) ) ){
-                    ptr->next = (VMA->vm_blocks)+i; 
-                    ptr = ptr->next;
-                    ptr->addr = va;
-                    ptr->offset = count*PGSIZE;
-                    count++;
-                    break;
-                }
-            }
-        }
-    }
-    ptr->next = 0;
+    VMA->vm_fault_around = FAULTAROUND;
 
     // increase file's reference count
-    filedup(VMA->vm_file);
+    VMA->vm_file = f ? filedup(f) : 0;
+
+    // shared anonymous pages must be the same frames in every
+    // process that forks from here, so they are allocated now.
+    if((flags & MAP_ANONYMOUS) && (flags & MAP_SHARED)){
+        if(vma_populate(p, VMA, start, start + length) != length / PGSIZE){
+            vma_unmap(p, VMA, VMA->vm_start, VMA->vm_end);
+            vma_remove(p, VMA);
+            goto bad;
+        }
+    } else if(flags & MAP_POPULATE){
+        uint64 t0 = r_time();
+        __sync_fetch_and_add(&mmstat.populated,
+                             vma_populate(p, VMA, start, start + length));
+        __sync_fetch_and_add(&mmstat.populate_time, r_time() - t0);
+    }
      
-    return VMA->vm_head->next->addr;
+    return start;
  bad:
     return -1;
 }
 
+// unmap every mapped page of [addr, addr+length), which may
+// span several vmas and holes between them, or punch a hole
+// in one. fails only if nothing in the range is mapped.
 uint64 sys_munmap(void){
-    uint64 addr;
+    uint64 addr, end;
     size_t length;
     argaddr(0, &addr);
     argaddr(1, &length);
     addr = PGROUNDDOWN(addr);
     length = PGROUNDUP(length);
 
-    struct proc *p = myproc();   
-    struct vma *VMA;
-    struct vm_block *ptr;
-    if(!findVMA(addr, &VMA, &ptr)){
+    struct proc *p = myproc();
+    end = addr + length;
+    if(end <= addr || vma_overlap(p, addr, end) == 0){
     //    printf("invalid addr\n");
         goto bad;
-    }           
-    int num_pages = length/PGSIZE;
-
-    // after calling findVMA, ptr is the block before the
-    // vm_block we want to unmap, we delete node and
-    // maintain linked list
-    struct vm_block *start = ptr;
-    struct vm_block *next = ptr->next;
-    uint64 old_offset;
-    while(num_pages > 0 && ptr->next != 0){
-        next = ptr->next;
-
-        old_offset = VMA->vm_file->off;
-        VMA->vm_file->off = (next->offset);
-        writepage(VMA, VMA->vm_file, next->addr, PGSIZE);
-        VMA->vm_file->off = old_offset;
-
-        // ensure that the address is mapped
-        // otherwise it'll raise unmap error
-        if(walkaddr(p->pagetable, next->addr) != 0)
-            uvmunmap(p->pagetable, next->addr, 1, 1); 
-        // maintain linked list
-        next->addr = 0;
-        ptr->next = 0;
-        ptr = next;
-        num_pages--;
-    }
-    // maintain linked list and vma
-    if(ptr->next != 0)
-        start->next = ptr->next;
-    if(VMA->vm_head->next == 0)
-        VMA->vm_head->addr = 0, VMA->vm_head = 0, fileclose(VMA->vm_file);
-    for(int i = 0; i < 16; i++){
-        VMA = p->vmas+i;
-        if(VMA->vm_head != 0 && VMA->vm_head->next != 0)
-            return 0;
     }
+
+    if(vma_unmap_range(p, addr, end) != 0)
+        goto bad;
     return 0;
  bad:
     return -1;
 }
+// flush the dirty pages of [addr, addr+length) to their files
+// without unmapping them. every page of the range must be mapped.
+// MS_INVALIDATE is accepted but does nothing: every mapping of a
+// file page maps the page cache's frame, so none can be stale.
+uint64 sys_msync(void){
+    uint64 addr, end, va;
+    size_t length;
+    int flags;
+    struct proc *p = myproc();
+    struct vma *VMA;
+    int r = 0;
+
+    if(argaddr(0, &addr) < 0 || argaddr(1, &length) < 0 || argint(2, &flags) < 0)
+        return -1;
+    if((addr % PGSIZE) != 0 || (flags & ~(MS_ASYNC|MS_SYNC|MS_INVALIDATE)))
+        return -1;
+    if((flags & MS_ASYNC) && (flags & MS_SYNC))
+        return -1;
+    end = PGROUNDUP(addr + length);
+    if(length > 0 && end <= addr)
+        return -1;
+    for(va = addr; va < end; va = VMA->vm_end){
+        if((VMA = vma_find(p, va)) == 0){
+            r = -1;
+            break;
+        }
+        vma_sync(p, VMA, va, VMA->vm_end < end ? VMA->vm_end : end, flags);
+    }
+    // the dirty bits were cleared in place.
+    sfence_vma();
+    return r;
+}
+
+// advise the kernel how [addr, addr+length) will be used.
+// every page of the range must be mapped.
+uint64 sys_madvise(void){
+    uint64 addr, end, va, e;
+    size_t length;
+    int advice;
+    struct proc *p = myproc();
+    struct vma *VMA;
+
+    if(argaddr(0, &addr) < 0 || argaddr(1, &length) < 0 || argint(2, &advice) < 0)
+        return -1;
+    if((addr % PGSIZE) != 0 || advice < MADV_NORMAL || advice > MADV_NOHUGEPAGE)
+        return -1;
+    end = PGROUNDUP(addr + length);
+    if(length > 0 && end <= addr)
+        return -1;
+    for(va = addr; va < end; va = e){
+        if((VMA = vma_find(p, va)) == 0)
+            return -1;
+        e = VMA->vm_end < end ? VMA->vm_end : end;
+        if(vma_advise(p, VMA, va, e, advice) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// resize the mapping of [addr, addr+old_length) to new_length
+// and return its address, which changes only if flags has
+// MREMAP_MAYMOVE and the pages after the range are taken.
+// the range must lie in one mapping.
+uint64 sys_mremap(void){
+    uint64 addr, end, start;
+    size_t oldlen, newlen;
+    int flags;
+    struct proc *p = myproc();
+    struct vma *VMA;
+
+    if(argaddr(0, &addr) < 0 || argaddr(1, &oldlen) < 0 ||
+       argaddr(2, &newlen) < 0 || argint(3, &flags) < 0)
+        return -1;
+    if((addr % PGSIZE) != 0 || oldlen == 0 || newlen == 0 ||
+       (flags & ~MREMAP_MAYMOVE))
+        return -1;
+    oldlen = PGROUNDUP(oldlen);
+    newlen = PGROUNDUP(newlen);
+    end = addr + oldlen;
+    if((VMA = vma_find(p, addr)) == 0 || end > VMA->vm_end)
+        return -1;
+    // file offsets are 32 bits wide.
+    if(newlen > 0xffffffffUL - (VMA->vm_pgoff + (addr - VMA->vm_start)))
+        return -1;
+    if(newlen == oldlen)
+        return addr;
+
+    // resize a vma that is exactly the old range.
+    if(addr > VMA->vm_start && (VMA = vma_split(p, VMA, addr)) == 0)
+        return -1;
+    if(end < VMA->vm_end && vma_split(p, VMA, end) == 0)
+        return -1;
+    start = vma_remap(p, VMA, newlen, flags & MREMAP_MAYMOVE);
+    // any PTEs that moved or went were changed in place.
+    sfence_vma();
+    return start ? start : -1;
+}
+
+// change the protection of [addr, addr+length) to prot.
+// every page of the range must be mapped, and a shared file
+// mapping can only be made writable if its file was opened so.
+uint64 sys_mprotect(void){
+    uint64 addr, end, va, e;
+    size_t length;
+    int prot, r = 0;
+    struct proc *p = myproc();
+    struct vma *VMA;
+
+    if(argaddr(0, &addr) < 0 || argaddr(1, &length) < 0 || argint(2, &prot) < 0)
+        return -1;
+    if((addr % PGSIZE) != 0 || prot < 0 || prot > 7)
+        return -1;
+    end = PGROUNDUP(addr + length);
+    if(length > 0 && end <= addr)
+        return -1;
+    // check the whole range first, so that a bad one changes nothing.
+    for(va = addr; va < end; va = VMA->vm_end){
+        if((VMA = vma_find(p, va)) == 0)
+            return -1;
+        if((prot & PROT_WRITE) && (VMA->vm_flags & MAP_SHARED) &&
+           VMA->vm_file && !VMA->vm_file->writable)
+            return -1;
+    }
+    for(va = addr; va < end; va = e){
+        VMA = vma_find(p, va);
+        e = VMA->vm_end < end ? VMA->vm_end : end;
+        if(vma_protect(p, VMA, va, e, prot) < 0){
+            r = -1;
+            break;
+        }
+    }
+    // the PTEs were rewritten in place; one flush covers them all.
+    sfence_vma();
+    return r;
+}
+
+// set how many pages a fault on the mapping at addr may map,
+// counting the faulting one; 0 or 1 turns fault-around off.
+// returns the previous setting.
+uint64 sys_faultaround(void){
+    uint64 addr;
+    int npages, old;
+    struct vma *VMA;
+
+    if(argaddr(0, &addr) < 0 || argint(1, &npages) < 0 || npages < 0)
+        return -1;
+    if((VMA = vma_find(myproc(), addr)) == 0)
+        return -1;
+    old = VMA->vm_fault_around;
+    VMA->vm_fault_around = npages;
+    return old;
+}
+
+// copy the mmap paging counters out to user space.
+uint64 sys_mmapstat(void){
+    uint64 addr;
+
+    if(argaddr(0, &addr) < 0)
+        return -1;
+    if(copyout(myproc()->pagetable, addr, (char*)&mmstat, sizeof(mmstat)) < 0)
+        return -1;
+    return 0;
+}
+
+// copy the physical memory counters out to user space.
+uint64 sys_kmemstat(void){
+    uint64 addr;
+    struct kmemstat st;
+
+    if(argaddr(0, &addr) < 0)
+        return -1;
+    kmemstat(&st);
+    if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+        return -1;
+    return 0;
+}
+
 uint64 sys_vmprint(void){
     pagetable_t pagetable = myproc()->pagetable;
     printf("page table %p\n", pagetable);
@@ -309,6 +440,8 @@ uint64 sys_vmprint(void){
                 if( pte_L1 & PTE_V ){
                     pagetable_t child_L0 = (pagetable_t)PTE2PA(pte_L1);
                     printf(" .. ..%d: pte %p pa %p\n", j, pte_L1, child_L0);
+                    if(PTE_LEAF(pte_L1))
+                        continue;    // a megapage
 
                     for(int k = 0; k < 512; k++){
                         pte_t pte_L0 = child_L0[k];
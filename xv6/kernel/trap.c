@@ -3,16 +3,20 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "readahead.h"
 #include "proc.h"
 #include "defs.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
 #include "fcntl.h"
+#include "mmapstat.h"
 
 struct spinlock tickslock;
 uint ticks;
 
+struct mmapstat mmstat;
+
 extern char trampoline[], uservec[], userret[];
 
 // in kernelvec.S, calls kerneltrap().
@@ -34,86 +38,215 @@ trapinithart(void)
 }
 
 // mp2
-// find corresponding vma and vm_block
-static int findVMA(uint64 va, struct vma **VMA, struct proc *p){
-    struct vm_block *ptr;
-    for(int i = 0; i < 16; i++){
-        ptr = p->vmas[i].vm_head; 
-        if(ptr == 0)
+// map the pages around va that are already in the page cache
+// and not mapped yet, so that a scan through a mapped file does
+// not trap once per page. the window is the aligned run of
+// vm_fault_around pages holding va, clipped to the vma and to
+// the end of the file, which is size bytes long.
+// returns the number of pages mapped.
+static int fault_around(struct proc *p, struct vma *VMA, uint64 va,
+                        int pte_per, uint size){
+    uint64 n = VMA->vm_fault_around, start, end, a;
+    struct inode *ip = VMA->vm_file->ip;
+    pte_t *pte;
+    char *pa;
+    int count = 0;
+
+    if(VMA->vm_advice == MADV_RANDOM)
+        return 0;
+    if(VMA->vm_advice == MADV_SEQUENTIAL)
+        n *= 2;
+    if(n <= 1 || VMA->vm_pgoff >= size)
+        return 0;
+    start = VMA->vm_start + (va - VMA->vm_start) / (n*PGSIZE) * (n*PGSIZE);
+    end = start + n*PGSIZE;
+    if(end > VMA->vm_end)
+        end = VMA->vm_end;
+    if(end > VMA->vm_start + PGROUNDUP(size - VMA->vm_pgoff))
+        end = VMA->vm_start + PGROUNDUP(size - VMA->vm_pgoff);
+    for(a = start; a < end; a += PGSIZE){
+        if(a == va)
+            continue;
+        if((pte = walk(p->pagetable, a, 0)) != 0 && (*pte & PTE_V))
+            continue;
+        if((pa = pcache_peek(ip, (VMA->vm_pgoff + (a - VMA->vm_start)) / PGSIZE)) == 0)
             continue;
-        while(ptr->next != 0){
-            ptr = ptr->next;
-            if(ptr->addr == va){
-                *VMA = p->vmas+i;
-                return 1;
-            }
+        if(mappages(p->pagetable, a, PGSIZE, (uint64)pa, pte_per) != 0){
+            kfree(pa);
+            break;
         }
+        count++;
     }
+    return count;
+}
+
+// back the whole 2MB block holding va with a zeroed megapage,
+// if the block lies inside the anonymous vma and nothing in it
+// is mapped yet. one fault and one TLB entry then cover 512
+// pages. returns 0 on success, -1 to fall back to a single page.
+static int mmap_mega(struct proc *p, struct vma *VMA, uint64 va,
+                     int pte_per){
+    uint64 start = MEGAROUNDDOWN(va);
+    char *pa;
+
+    if(VMA->vm_nohuge || start < VMA->vm_start ||
+       start + MEGASIZE > VMA->vm_end)
+        return -1;
+    // look before allocating: once any page of the block is in,
+    // every later fault in it would zero 2MB only to give it back.
+    if(!megaempty(p->pagetable, start) ||
+       (pa = kalloc_order(MEGAORDER)) == 0)
+        return -1;
+    memset(pa, 0, MEGASIZE);
+    if(mapmega(p->pagetable, start, (uint64)pa, pte_per) != 0){
+        kfree_order(pa, MEGAORDER);
+        return -1;
+    }
+    __sync_fetch_and_add(&mmstat.megapages, 1);
     return 0;
 }
+
+// handle a page fault on an mmap region
 int mmap_allocate(uint64 va, int scause, struct proc *p){
+    uint64 t0 = r_time();
     struct vma *VMA = 0;
     va = PGROUNDDOWN(va);
-    if(findVMA(va, &VMA, p) == 0 ){
+    if((VMA = vma_find(p, va)) == 0 ){
         //printf("not mmap page fault\n");
         goto bad;
     }
-    int pte_per = 0;
-    if(VMA->vm_prot & PROT_READ)
-        pte_per |= PTE_R;
-    if(VMA->vm_prot & PROT_WRITE)
-        pte_per |= PTE_W;
-    if(scause == 13 && !(pte_per & PTE_R) ){
+    int pte_per = vma_perm(VMA);
+    if(scause == 13 && !(VMA->vm_prot & PROT_READ) ){
         //printf("lack read permission\n");
         goto bad;
     }
-    if(scause == 15 && !(pte_per & PTE_W) ){
+    if(scause == 15 && !(VMA->vm_prot & PROT_WRITE) ){
         //printf("lack write permission\n");
         goto bad;
     }
-    pte_per |= PTE_V;
-    pte_per |= PTE_U;
-
-    // child will copy its memory from parent
-    // if MAP_SHARED is set on
-    if(p->parent->pid != 2 && (VMA->vm_flags & MAP_SHARED) &&
-       walkaddr(p->parent->pagetable, va) != 0){
-        char *tmp = kalloc();
-        uvmalloc_prot(p->pagetable, va, va+PGSIZE, pte_per);
-        if( copyin(p->parent->pagetable, tmp, va, PGSIZE) == -1){
-        //    printf("copyin fail\n");
-            goto bad;
+
+    // already mapped, so this is a genuine protection fault
+    if(walkaddr(p->pagetable, va) != 0)
+        goto bad;
+
+    // all mappings of a file page share the page cache's frame.
+    // a writable private mapping shares it copy-on-write, and
+    // a write fault takes the private copy right away.
+    int cache_per = pte_per;
+    if((VMA->vm_flags & MAP_PRIVATE) && (pte_per & PTE_W))
+        cache_per = (pte_per & ~PTE_W) | PTE_COW;
+    char *pa, *mem;
+    if(VMA->vm_file == 0){
+        // anonymous memory: a private mapping reads the shared
+        // zero page until it writes; anything else gets a
+        // zeroed megapage or frame of its own.
+        if(!((VMA->vm_flags & MAP_PRIVATE) && scause != 15) &&
+           mmap_mega(p, VMA, va, pte_per) == 0){
+            __sync_fetch_and_add(&mmstat.faults, 1);
+            __sync_fetch_and_add(&mmstat.mapped, MEGASIZE / PGSIZE);
+            __sync_fetch_and_add(&mmstat.fault_time, r_time() - t0);
+            return 0;
         }
-        if( copyout(p->pagetable, va, tmp, PGSIZE) == -1){
-        //    printf("copyout fail\n"); 
+        if((VMA->vm_flags & MAP_PRIVATE) && scause != 15){
+            pa = zeropage;
+            kaddref(pa);
+            pte_per = cache_per;
+        } else {
+            if((pa = kalloc_zeroed()) == 0)
+                goto bad;
+        }
+        if(mappages(p->pagetable, va, PGSIZE, (uint64)pa, pte_per) != 0){
+            kfree(pa);
             goto bad;
         }
-        kfree(tmp);
+        __sync_fetch_and_add(&mmstat.faults, 1);
+        __sync_fetch_and_add(&mmstat.mapped, 1);
+        __sync_fetch_and_add(&mmstat.fault_time, r_time() - t0);
         return 0;
     }
-
-    // grow memory and map, same as sbrk
-    // uvmalloc_prot is written by me at kernel/vm.c
-    if( (uvmalloc_prot(p->pagetable, va, va+PGSIZE, pte_per)) == 0){
-        //printf("grow proc fail\n");
+    struct inode *ip = VMA->vm_file->ip;
+    uint off = VMA->vm_pgoff + (va - VMA->vm_start), size;
+    ilock(ip);
+    if((pa = pcache_peek(ip, off / PGSIZE)) == 0){
+        if(VMA->vm_advice == MADV_SEQUENTIAL){
+            // every fault continues the stream, at the full window.
+            VMA->vm_ra.end = off;
+            VMA->vm_ra.win = RAMAX;
+        }
+        if(VMA->vm_advice != MADV_RANDOM)
+            readahead(ip, &VMA->vm_ra, off, PGSIZE);
+        pa = pcache_get(ip, off / PGSIZE, VMA->vm_flags & MAP_PRIVATE);
+    }
+    size = ip->size;
+    iunlock(ip);
+    if(pa == 0){
+        //printf("page cache fail\n");
         goto bad;
     }
-
-    // read the content of the file
-    // notice fileread will change the offset of the file
-    // we must recover it
-    uint64 old_offset = VMA->vm_file->off;
-    VMA->vm_file->off = va-(VMA->vm_head->next->addr);
-    if(fileread(VMA->vm_file, va, PGSIZE) < 0){
-        //printf("fileread error\n");
+    if((VMA->vm_flags & MAP_PRIVATE) && scause == 15){
+        if((mem = kalloc()) == 0){
+            kfree(pa);
+            goto bad;
+        }
+        memmove(mem, pa, PGSIZE);
+        kfree(pa);
+        pa = mem;
+    } else {
+        pte_per = cache_per;
+    }
+    if(mappages(p->pagetable, va, PGSIZE, (uint64)pa, pte_per) != 0){
+        kfree(pa);
         goto bad;
     }
-    VMA->vm_file->off = old_offset;
+    __sync_fetch_and_add(&mmstat.faults, 1);
+    __sync_fetch_and_add(&mmstat.mapped, 1);
+    __sync_fetch_and_add(&mmstat.mapped,
+                         fault_around(p, VMA, va, cache_per, size));
+    __sync_fetch_and_add(&mmstat.fault_time, r_time() - t0);
 
     return 0;
  bad:
     return -1;
 }
+
+// Handle a page fault at va by process p: a write to a
+// copy-on-write page, the first touch of a heap page that
+// sbrk() only reserved, or a fault on an mmap region.
+// Returns 0 if the access can be retried, -1 if it is bad.
+int
+page_fault(struct proc *p, uint64 va, int scause)
+{
+    if(scause == 15 && uvmcow(p->pagetable, va) == 0)
+        return 0;
+    if(va < p->sz)
+        return uvmlazy(p->pagetable, p->sz, va);
+    return mmap_allocate(va, scause, p);
+}
+
+// Fault in the pages of [va, va+len) of the current process,
+// for writing if write is set, before a system call copies to
+// or from them with locks held. copyin() and copyout() only
+// resolve heap and copy-on-write pages themselves, since an
+// mmap fault may need the very inode and buffer locks held
+// by a read() or write() of the mapped file. Stops at the
+// first bad page and leaves the copy to report it.
+void
+prefault(uint64 va, uint64 len, int write)
+{
+    struct proc *p = myproc();
+    uint64 a, size;
+    pte_t *pte;
+
+    if(va + len < va || va + len > MAXVA)
+        return;
+    for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+        pte = walkleaf(p->pagetable, a, &size);
+        if(pte && !(write && (*pte & PTE_COW)))
+            continue;
+        if(page_fault(p, a, write ? 15 : 13) < 0)
+            return;
+    }
+}
 //
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
@@ -153,7 +286,7 @@ usertrap(void)
     } else if((which_dev = devintr()) != 0){
         // ok
     } else if(r_scause() == 13 || r_scause() == 15){
-        if(mmap_allocate(r_stval(), r_scause(), myproc()) == 0){
+        if(page_fault(p, r_stval(), r_scause()) == 0){
         }
         else{
             printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
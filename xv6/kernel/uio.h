@@ -0,0 +1,7 @@
+// One piece of a scattered buffer, for readv() and writev().
+struct iovec {
+  void *iov_base;  // user address of the piece
+  uint64 iov_len;  // its length in bytes
+};
+
+#define IOV_MAX 16  // most pieces one readv() or writev() takes
@@ -63,6 +63,8 @@ static struct disk {
   struct {
     struct buf *b;
     char status;
+    char async;  // a prefetch; nobody sleeps waiting for it
+    int *wait;   // a virtio_disk_read(); counts its blocks in flight
   } info[NUM];
 
   // disk command headers.
@@ -200,25 +202,13 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// format the three descriptors idx for a transfer of block
+// blockno to or from data and hand them to the device.
+// caller has filled in disk.info[idx[0]] and holds vdisk_lock.
+static void
+virtio_disk_start(uint blockno, void *data, int write, int *idx)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
-
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
+  uint64 sector = blockno * (BSIZE / 512);
 
   // format the three descriptors.
   // qemu's virtio-blk.c reads them.
@@ -237,12 +227,12 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
+  disk.desc[idx[1]].addr = (uint64) data;
   disk.desc[idx[1]].len = BSIZE;
   if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
+    disk.desc[idx[1]].flags = 0; // device reads data
   else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes data
   disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
   disk.desc[idx[1]].next = idx[2];
 
@@ -252,10 +242,6 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
   disk.desc[idx[2]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
-
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
 
@@ -267,6 +253,30 @@ virtio_disk_rw(struct buf *b, int write)
   __sync_synchronize();
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  acquire(&disk.vdisk_lock);
+
+  // the spec's Section 5.2 says that legacy block operations use
+  // three descriptors: one for type/reserved/sector, one for the
+  // data, one for a 1-byte status result.
+
+  // allocate the three descriptors.
+  int idx[3];
+  while(1){
+    if(alloc3_desc(idx) == 0) {
+      break;
+    }
+    sleep(&disk.free[0], &disk.vdisk_lock);
+  }
+
+  // record struct buf for virtio_disk_intr().
+  b->disk = 1;
+  disk.info[idx[0]].b = b;
+  virtio_disk_start(b->blockno, b->data, write, idx);
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
@@ -279,6 +289,52 @@ virtio_disk_rw(struct buf *b, int write)
   release(&disk.vdisk_lock);
 }
 
+// start reading locked buf b and return without waiting.
+// virtio_disk_intr() marks b valid and hands it to bdone()
+// when the data arrives.
+// returns -1, without sleeping, if no descriptors are free.
+int
+virtio_disk_prefetch(struct buf *b)
+{
+  int idx[3];
+
+  acquire(&disk.vdisk_lock);
+  if(alloc3_desc(idx) < 0){
+    release(&disk.vdisk_lock);
+    return -1;
+  }
+  disk.info[idx[0]].async = 1;
+  b->disk = 1;
+  disk.info[idx[0]].b = b;
+  virtio_disk_start(b->blockno, b->data, 0, idx);
+  release(&disk.vdisk_lock);
+  return 0;
+}
+
+// read the n blocks in blocks[] into consecutive BSIZE pieces
+// of dst, which the device writes directly, bypassing the
+// buffer cache. all of them are in flight at once. a block
+// number of 0 leaves its piece of dst alone.
+void
+virtio_disk_read(uint *blocks, int n, char *dst)
+{
+  int idx[3], pending = 0;
+
+  acquire(&disk.vdisk_lock);
+  for(int i = 0; i < n; i++){
+    if(blocks[i] == 0)
+      continue;
+    while(alloc3_desc(idx) != 0)
+      sleep(&disk.free[0], &disk.vdisk_lock);
+    disk.info[idx[0]].wait = &pending;
+    virtio_disk_start(blocks[i], dst + i*BSIZE, 0, idx);
+    pending++;
+  }
+  while(pending > 0)
+    sleep(&pending, &disk.vdisk_lock);
+  release(&disk.vdisk_lock);
+}
+
 void
 virtio_disk_intr()
 {
@@ -305,8 +361,25 @@ virtio_disk_intr()
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    if(disk.info[id].wait){
+      // a virtio_disk_read() block, with no buf; the reader
+      // wakes up once all of its blocks are in.
+      if(--*disk.info[id].wait == 0)
+        wakeup(disk.info[id].wait);
+      disk.info[id].wait = 0;
+      free_chain(id);
+    } else if(disk.info[id].async){
+      b->disk = 0;   // disk is done with buf
+      // no virtio_disk_rw() is waiting to clean up.
+      disk.info[id].b = 0;
+      disk.info[id].async = 0;
+      free_chain(id);
+      b->valid = 1;
+      bdone(b);
+    } else {
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+    }
 
     disk.used_idx += 1;
   }
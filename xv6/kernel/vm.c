@@ -5,6 +5,9 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "readahead.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -21,8 +24,7 @@ kvmmake(void)
 {
     pagetable_t kpgtbl;
 
-    kpgtbl = (pagetable_t) kalloc();
-    memset(kpgtbl, 0, PGSIZE);
+    kpgtbl = (pagetable_t) kalloc_zeroed();
 
     // uart registers
     kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -36,7 +38,8 @@ kvmmake(void)
     // map kernel text executable and read-only.
     kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
-    // map kernel data and the physical RAM we'll make use of.
+    // map kernel data and the physical RAM we'll make use of,
+    // with megapages from the first 2MB boundary on.
     kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
     // map the trampoline for trap entry/exit to
@@ -77,6 +80,9 @@ kvminithart()
 //     21..29 -- 9 bits of level-1 index.
 //     12..20 -- 9 bits of level-0 index.
 //        0..11 -- 12 bits of byte offset within the page.
+//
+// A megapage maps va with no level-0 PTE at all, so walk()
+// returns 0 for it; see walkleaf().
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -86,48 +92,160 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
     for(int level = 2; level > 0; level--) {
         pte_t *pte = &pagetable[PX(level, va)];
         if(*pte & PTE_V) {
+            if(PTE_LEAF(*pte)){
+                if(alloc)
+                    panic("walk: megapage");
+                return 0;
+            }
             pagetable = (pagetable_t)PTE2PA(*pte);
         } else {
-            if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+            if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
                 return 0;
-            memset(pagetable, 0, PGSIZE);
             *pte = PA2PTE(pagetable) | PTE_V;
         }
     }
     return &pagetable[PX(0, va)];
 }
 
-// Look up a virtual address, return the physical address,
-// or 0 if not mapped.
-// Can only be used to look up user pages.
-uint64
-walkaddr(pagetable_t pagetable, uint64 va)
+// Return the valid leaf PTE that maps va, a page's or a
+// megapage's, and set *size to the number of bytes it maps.
+// Returns 0 if va is not mapped.
+pte_t *
+walkleaf(pagetable_t pagetable, uint64 va, uint64 *size)
 {
     pte_t *pte;
-    uint64 pa;
 
     if(va >= MAXVA)
         return 0;
+    for(int level = 2; level >= 0; level--){
+        pte = &pagetable[PX(level, va)];
+        if((*pte & PTE_V) == 0)
+            return 0;
+        if(PTE_LEAF(*pte) || level == 0){
+            *size = 1L << PXSHIFT(level);
+            return pte;
+        }
+        pagetable = (pagetable_t)PTE2PA(*pte);
+    }
+    return 0;
+}
 
-    pte = walk(pagetable, va, 0);
-    if(pte == 0)
-        return 0;
-    if((*pte & PTE_V) == 0)
+// Look up a virtual address, return the physical address
+// of its page, or 0 if not mapped.
+// Can only be used to look up user pages.
+uint64
+walkaddr(pagetable_t pagetable, uint64 va)
+{
+    pte_t *pte;
+    uint64 size;
+
+    if((pte = walkleaf(pagetable, va, &size)) == 0)
         return 0;
     if((*pte & PTE_U) == 0)
         return 0;
-    pa = PTE2PA(*pte);
-    return pa;
+    return PTE2PA(*pte) + PGROUNDDOWN(va & (size - 1));
 }
 
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
+// aligned 2MB runs are mapped with megapages, which need no
+// leaf page table and cover 512 times as much per TLB entry.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-    if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-        panic("kvmmap");
+    uint64 n;
+
+    while(sz > 0){
+        if(va % MEGASIZE == 0 && pa % MEGASIZE == 0 && sz >= MEGASIZE){
+            n = MEGASIZE;
+            if(mapmega(kpgtbl, va, pa, perm) != 0)
+                panic("kvmmap");
+        } else {
+            n = MEGASIZE - va % MEGASIZE;
+            if(n > sz)
+                n = sz;
+            if(mappages(kpgtbl, va, n, pa, perm) != 0)
+                panic("kvmmap");
+        }
+        va += n;
+        pa += n;
+        sz -= n;
+    }
+}
+
+// Is nothing mapped in the MEGASIZE block holding va? The
+// level-1 PTE must be absent, or point to a leaf page table
+// with no valid PTE.
+int
+megaempty(pagetable_t pagetable, uint64 va)
+{
+    pte_t *pte = &pagetable[PX(2, va)];
+    pagetable_t table;
+    int i;
+
+    if((*pte & PTE_V) == 0)
+        return 1;
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+    if((*pte & PTE_V) == 0)
+        return 1;
+    if(PTE_LEAF(*pte))
+        return 0;
+    table = (pagetable_t)PTE2PA(*pte);
+    for(i = 0; i < 512; i++)
+        if(table[i] & PTE_V)
+            return 0;
+    return 1;
+}
+
+// Map the megapage at va to pa, both MEGASIZE-aligned, with a
+// leaf PTE in the level-1 page table. An empty leaf page table
+// there is freed first. Returns 0 on success, -1 if memory ran
+// out or something in the range is mapped already.
+int
+mapmega(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+    pte_t *pte = &pagetable[PX(2, va)];
+
+    if(!megaempty(pagetable, va))
+        return -1;
+    if(*pte & PTE_V){
+        pagetable = (pagetable_t)PTE2PA(*pte);
+    } else {
+        if((pagetable = (pagetable_t)kalloc_zeroed()) == 0)
+            return -1;
+        *pte = PA2PTE(pagetable) | PTE_V;
+    }
+    pte = &pagetable[PX(1, va)];
+    if(*pte & PTE_V)
+        kfree((void*)PTE2PA(*pte));
+    *pte = PA2PTE(pa) | perm | PTE_V;
+    return 0;
+}
+
+// If va lies in a megapage, turn the megapage into a leaf page
+// table of 512 PTEs for the same frames, with the same flags, so
+// that part of it can be unmapped or changed. Each frame of a
+// megapage has its own reference already. The translation stays
+// the same, so the TLB need not be flushed.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmdemote(pagetable_t pagetable, uint64 va)
+{
+    pte_t *pte;
+    pagetable_t table;
+    uint64 size;
+
+    if((pte = walkleaf(pagetable, va, &size)) == 0 || size == PGSIZE)
+        return 0;
+    if(size != MEGASIZE)
+        panic("uvmdemote");
+    if((table = (pagetable_t)kalloc()) == 0)
+        return -1;
+    for(int i = 0; i < 512; i++)
+        table[i] = PA2PTE(PTE2PA(*pte) + i*PGSIZE) | PTE_FLAGS(*pte);
+    *pte = PA2PTE(table) | PTE_V;
+    return 0;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -157,22 +275,40 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never faulted in are skipped.
 // Optionally free the physical memory.
+// Walks once per leaf page table, skipping missing ones whole.
+// A megapage must lie wholly inside the range or outside it;
+// uvmdemote() splits one that does not.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-    uint64 a;
-    pte_t *pte;
+    uint64 a, size;
+    pte_t *pte = 0;
 
     if((va % PGSIZE) != 0)
         panic("uvmunmap: not aligned");
 
     for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-        if((pte = walk(pagetable, a, 0)) == 0)
-            panic("uvmunmap: walk");
+        if(pte == 0 || PX(0, a) == 0){
+            if((pte = walk(pagetable, a, 0)) == 0){
+                if((pte = walkleaf(pagetable, a, &size)) != 0){
+                    if(size != MEGASIZE || a % MEGASIZE != 0 ||
+                       a + MEGASIZE > va + npages*PGSIZE)
+                        panic("uvmunmap: part of a megapage");
+                    if(do_free)
+                        kfree_order((void*)PTE2PA(*pte), MEGAORDER);
+                    *pte = 0;
+                    pte = 0;
+                }
+                a = PXLAST(a);
+                continue;
+            }
+        } else {
+            pte++;
+        }
         if((*pte & PTE_V) == 0)
-            panic("uvmunmap: not mapped");
+            continue;
         if(PTE_FLAGS(*pte) == PTE_V)
             panic("uvmunmap: not a leaf");
         if(do_free){
@@ -189,10 +325,9 @@ pagetable_t
 uvmcreate()
 {
     pagetable_t pagetable;
-    pagetable = (pagetable_t) kalloc();
+    pagetable = (pagetable_t) kalloc_zeroed();
     if(pagetable == 0)
         return 0;
-    memset(pagetable, 0, PGSIZE);
     return pagetable;
 }
 
@@ -206,12 +341,37 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
     if(sz >= PGSIZE)
         panic("inituvm: more than a page");
-    mem = kalloc();
-    memset(mem, 0, PGSIZE);
+    mem = kalloc_zeroed();
     mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
     memmove(mem, src, sz);
 }
 
+// Back the page at va of a process of size sz with zeroed memory,
+// if it lies in the process but was never touched. sbrk() grows
+// the heap without allocating; this is where its pages appear.
+// Returns 0 on success, -1 if va is not such a page or memory
+// ran out.
+int
+uvmlazy(pagetable_t pagetable, uint64 sz, uint64 va)
+{
+    pte_t *pte;
+    char *mem;
+
+    va = PGROUNDDOWN(va);
+    if(va >= sz)
+        return -1;
+    // mapped already, maybe as the stack guard page.
+    if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V))
+        return -1;
+    if((mem = kalloc_zeroed()) == 0)
+        return -1;
+    if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+        kfree(mem);
+        return -1;
+    }
+    return 0;
+}
+
 // Allocate PTEs and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.    Returns new size or 0 on error.
 uint64
@@ -225,12 +385,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
     oldsz = PGROUNDUP(oldsz);
     for(a = oldsz; a < newsz; a += PGSIZE){
-        mem = kalloc();
+        mem = kalloc_zeroed();
         if(mem == 0){
             uvmdealloc(pagetable, a, oldsz);
             return 0;
         }
-        memset(mem, 0, PGSIZE);
         if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
             kfree(mem);
             uvmdealloc(pagetable, a, oldsz);
@@ -259,7 +418,8 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 }
 
 // Recursively free page-table pages.
-// All leaf mappings must already have been removed.
+// All leaf mappings, megapages included, must already have
+// been removed.
 void
 freewalk(pagetable_t pagetable)
 {
@@ -288,34 +448,61 @@ uvmfree(pagetable_t pagetable, uint64 sz)
     freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Map the page at va of old into new at the same address,
+// sharing the frame. A writable page becomes copy-on-write
+// in both, so whichever process writes it first gets its own
+// copy from uvmcow(). The caller must flush old's TLB; the
+// return to user space does that.
+// Returns 0 on success, -1 if a page-table page can't be allocated.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 va)
+{
+    pte_t *pte;
+    uint64 pa;
+
+    if((pte = walk(old, va, 0)) == 0 || (*pte & PTE_V) == 0)
+        panic("uvmshare: page not present");
+    if(*pte & PTE_W)
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+    pa = PTE2PA(*pte);
+    if(mappages(new, va, PGSIZE, pa, PTE_FLAGS(*pte)) != 0)
+        return -1;
+    kaddref((void*)pa);
+    return 0;
+}
+
+// Given a parent process's page table, give a child's
+// page table the same memory. The physical pages are
+// shared copy-on-write rather than copied.
+// Walks once per leaf page table, and skips the pages of
+// missing level-1 and leaf tables whole, so a large heap
+// that sbrk() only reserved costs next to nothing.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-    pte_t *pte;
-    uint64 pa, i;
-    uint flags;
-    char *mem;
+    pte_t *pte = 0;
+    uint64 i;
 
     for(i = 0; i < sz; i += PGSIZE){
-        if((pte = walk(old, i, 0)) == 0)
-            panic("uvmcopy: pte should exist");
+        // heap pages not touched yet stay lazy in the child.
+        if((old[PX(2, i)] & PTE_V) == 0){
+            i = PGROUNDDOWN(i | ((1L << PXSHIFT(2)) - 1));
+            continue;
+        }
+        if(pte == 0 || PX(0, i) == 0){
+            if((pte = walk(old, i, 0)) == 0){
+                i = PXLAST(i);
+                continue;
+            }
+        } else {
+            pte++;
+        }
         if((*pte & PTE_V) == 0)
-            panic("uvmcopy: page not present");
-        pa = PTE2PA(*pte);
-        flags = PTE_FLAGS(*pte);
-        if((mem = kalloc()) == 0)
+            continue;
+        if(uvmshare(old, new, i) != 0)
             goto err;
-        memmove(mem, (char*)pa, PGSIZE);
-        if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-            kfree(mem);
-            goto err;
-        }
     }
     return 0;
 
@@ -324,6 +511,73 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
     return -1;
 }
 
+// Resolve a write to the copy-on-write page at va: give the
+// process a writable copy of its own, or simply make the page
+// writable if no one else holds the frame any more.
+// Returns 0 on success, -1 if va is not a copy-on-write user
+// page or memory ran out.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+    pte_t *pte;
+    uint64 pa;
+    char *mem;
+
+    if(va >= MAXVA)
+        return -1;
+    pte = walk(pagetable, va, 0);
+    if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+        return -1;
+    pa = PTE2PA(*pte);
+    if(krefcount((void*)pa) > 1){
+        if((mem = kalloc()) == 0)
+            return -1;
+        memmove(mem, (char*)pa, PGSIZE);
+        *pte = PA2PTE(mem) | PTE_FLAGS(*pte);
+        kfree((void*)pa);
+    }
+    *pte = (*pte & ~PTE_COW) | PTE_W;
+    return 0;
+}
+
+// Move the PTEs of [old, old+len) to [new, new+len), keeping
+// their frames and flags. The ranges are page-aligned and must
+// not overlap, and nothing may be mapped at new. The leaf page
+// tables for new are allocated first, so on failure nothing has
+// moved. Megapages at old are demoted and move as pages.
+// The caller flushes the TLB.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmmove(pagetable_t pagetable, uint64 old, uint64 new, uint64 len)
+{
+    uint64 a;
+    pte_t *from = 0, *to = 0;
+
+    for(a = 0; a < len; a += MEGASIZE - (old + a) % MEGASIZE)
+        if(uvmdemote(pagetable, old + a) != 0)
+            return -1;
+    for(a = 0; a < len; a += PGSIZE)
+        if((a == 0 || PX(0, new + a) == 0) && walk(pagetable, new + a, 1) == 0)
+            return -1;
+    for(a = 0; a < len; a += PGSIZE){
+        if(to == 0 || PX(0, new + a) == 0)
+            to = walk(pagetable, new + a, 0);
+        else
+            to++;
+        if(from == 0 || PX(0, old + a) == 0)
+            from = walk(pagetable, old + a, 0);
+        else
+            from++;
+        if(from == 0 || (*from & PTE_V) == 0)
+            continue;
+        if(*to & PTE_V)
+            panic("uvmmove: remap");
+        *to = *from;
+        *from = 0;
+    }
+    return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -337,19 +591,45 @@ uvmclear(pagetable_t pagetable, uint64 va)
     *pte &= ~PTE_U;
 }
 
+// Materialise the lazy heap page at va0 of the current process,
+// if pagetable is its page table, for a copy to or from it.
+// Returns 0 if the page is there now.
+static int
+copyfault(pagetable_t pagetable, uint64 va0)
+{
+    struct proc *p = myproc();
+
+    if(p == 0 || pagetable != p->pagetable)
+        return -1;
+    return uvmlazy(pagetable, p->sz, va0);
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-    uint64 n, va0, pa0;
+    uint64 n, va0, pa0, size;
+    pte_t *pte;
 
     while(len > 0){
         va0 = PGROUNDDOWN(dstva);
-        pa0 = walkaddr(pagetable, va0);
-        if(pa0 == 0)
+        if(va0 >= MAXVA)
+            return -1;
+        pte = walkleaf(pagetable, va0, &size);
+        if(pte == 0 && copyfault(pagetable, va0) == 0)
+            pte = walkleaf(pagetable, va0, &size);
+        if(pte == 0 || (*pte & PTE_U) == 0)
+            return -1;
+        if((*pte & PTE_COW) && uvmcow(pagetable, va0) != 0)
+            return -1;
+        if((*pte & PTE_W) == 0)
             return -1;
+        pa0 = PTE2PA(*pte) + (va0 & (size - 1));
+        // the write below goes through the kernel's direct map,
+        // so mark the user page dirty for mmap writeback.
+        *pte |= PTE_D;
         n = PGSIZE - (dstva - va0);
         if(n > len)
             n = len;
@@ -373,6 +653,8 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
     while(len > 0){
         va0 = PGROUNDDOWN(srcva);
         pa0 = walkaddr(pagetable, va0);
+        if(pa0 == 0 && copyfault(pagetable, va0) == 0)
+            pa0 = walkaddr(pagetable, va0);
         if(pa0 == 0)
             return -1;
         n = PGSIZE - (srcva - va0);
@@ -400,6 +682,8 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
     while(got_null == 0 && max > 0){
         va0 = PGROUNDDOWN(srcva);
         pa0 = walkaddr(pagetable, va0);
+        if(pa0 == 0 && copyfault(pagetable, va0) == 0)
+            pa0 = walkaddr(pagetable, va0);
         if(pa0 == 0)
             return -1;
         n = PGSIZE - (srcva - va0);
@@ -445,6 +729,8 @@ void vmprint(pagetable_t pagetable){
                 if( pte_L1 & PTE_V ){
                     pagetable_t child_L0 = (pagetable_t)PTE2PA(pte_L1);
                     printf(" .. ..%d: pte %p pa %p\n", j, pte_L1, child_L0);
+                    if(PTE_LEAF(pte_L1))
+                        continue;    // a megapage
 
                     for(int k = 0; k < 512; k++){
                         pte_t pte_L0 = child_L0[k];
@@ -473,12 +759,11 @@ uvmalloc_prot(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int flag)
 
     oldsz = PGROUNDUP(oldsz);
     for(a = oldsz; a < newsz; a += PGSIZE){
-        mem = kalloc();
+        mem = kalloc_zeroed();
         if(mem == 0){
             uvmdealloc(pagetable, a, oldsz);
             return 0;
         }
-        memset(mem, 0, PGSIZE);
         if(mappages(pagetable, a, PGSIZE, (uint64)mem, flag|PTE_U|PTE_V) != 0){
             kfree(mem);
             uvmdealloc(pagetable, a, oldsz);
@@ -0,0 +1,801 @@
+//
+// mp2: mmap regions.
+//
+// struct vma entries come from a slab cache and are handed out
+// by mmap, so a process that maps nothing costs nothing.
+// p->vmas[0..p->nvma) points at non-overlapping [vm_start, vm_end)
+// ranges sorted by vm_start. lookups are a binary search, and
+// the file offset of any page is vm_pgoff + (va - vm_start).
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "readahead.h"
+#include "proc.h"
+#include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "mmapstat.h"
+
+struct kmem_cache *vmacache;
+
+// msync(MS_ASYNC) hands dirty pages to the msyncd kernel process
+// through this queue. each entry holds a reference to the file
+// and one to the frame, so the page may be unmapped and the file
+// closed before msyncd gets to it.
+#define NWBQ 64
+#define WBBATCH ((MAXOPBLOCKS-2)*BSIZE/PGSIZE) // pages per transaction
+
+struct wbent {
+    struct file *f;
+    uint off;
+    char *pa;
+};
+
+struct {
+    struct spinlock lock;
+    struct wbent q[NWBQ];
+    int head;   // oldest queued entry
+    int n;      // number of queued entries
+} wbq;
+
+// a page of zeros that private anonymous mappings map read-only
+// (copy-on-write if writable) until they are first written.
+// vmainit() keeps its first reference, so it is never freed.
+char *zeropage;
+
+void
+vmainit(void)
+{
+    if((zeropage = kalloc_zeroed()) == 0)
+        panic("vmainit: zeropage");
+    initlock(&wbq.lock, "wbq");
+    vmacache = kmem_cache_create("vma", sizeof(struct vma), 0);
+}
+
+// Allocate a zeroed vma, or return 0 if out of memory.
+static struct vma*
+vma_alloc(void)
+{
+    struct vma *v;
+
+    if((v = kmem_cache_alloc(vmacache)) != 0)
+        memset(v, 0, sizeof(*v));
+    return v;
+}
+
+static void
+vma_free(struct vma *v)
+{
+    kmem_cache_free(vmacache, v);
+}
+
+// Return the vma of p that contains va, or 0 if va is not mapped.
+struct vma*
+vma_find(struct proc *p, uint64 va)
+{
+    int lo = 0, hi = p->nvma;
+
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        struct vma *v = p->vmas[mid];
+        if(va < v->vm_start)
+            hi = mid;
+        else if(va >= v->vm_end)
+            lo = mid + 1;
+        else
+            return v;
+    }
+    return 0;
+}
+
+// Allocate an empty vma for [start, end) and insert it at its
+// sorted position in p's table. The caller must make sure the
+// range is free. Returns 0 if p's table is full or out of memory.
+struct vma*
+vma_insert(struct proc *p, uint64 start, uint64 end)
+{
+    struct vma *v;
+    int i;
+
+    if(p->nvma >= NVMA || (v = vma_alloc()) == 0)
+        return 0;
+    for(i = p->nvma; i > 0 && p->vmas[i-1]->vm_start > start; i--)
+        p->vmas[i] = p->vmas[i-1];
+    v->vm_start = start;
+    v->vm_end = end;
+    p->vmas[i] = v;
+    p->nvma++;
+    return v;
+}
+
+// Drop v from p's table, close its file and return it to the
+// cache. Does not touch the page table.
+void
+vma_remove(struct proc *p, struct vma *v)
+{
+    int i;
+
+    if(v->vm_file)
+        fileclose(v->vm_file);
+    for(i = 0; p->vmas[i] != v; i++)
+        ;
+    for(; i < p->nvma - 1; i++)
+        p->vmas[i] = p->vmas[i+1];
+    p->nvma--;
+    vma_free(v);
+}
+
+// Split v at page-aligned addr, which must lie strictly inside v.
+// v keeps [vm_start, addr) and the returned vma gets [addr, vm_end)
+// with its own file reference. A megapage across addr is demoted,
+// so that no megapage spans two vmas. Returns 0 if no vma or no
+// memory is available.
+struct vma*
+vma_split(struct proc *p, struct vma *v, uint64 addr)
+{
+    struct vma *nv;
+
+    if(addr % MEGASIZE != 0 && uvmdemote(p->pagetable, addr) != 0)
+        return 0;
+    if((nv = vma_insert(p, addr, v->vm_end)) == 0)
+        return 0;
+    nv->vm_flags = v->vm_flags;
+    nv->vm_prot = v->vm_prot;
+    nv->vm_pgoff = v->vm_pgoff + (addr - v->vm_start);
+    nv->vm_fault_around = v->vm_fault_around;
+    nv->vm_advice = v->vm_advice;
+    nv->vm_nohuge = v->vm_nohuge;
+    nv->vm_file = v->vm_file ? filedup(v->vm_file) : 0;
+    v->vm_end = addr;
+    return nv;
+}
+
+// Return the lowest vma of p that overlaps [start, end), or 0.
+struct vma*
+vma_overlap(struct proc *p, uint64 start, uint64 end)
+{
+    int lo = 0, hi = p->nvma;
+
+    // find the first vma that ends above start.
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(p->vmas[mid]->vm_end <= start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo < p->nvma && p->vmas[lo]->vm_start < end)
+        return p->vmas[lo];
+    return 0;
+}
+
+// May [start, start+len) hold mappings? It must be
+// page-aligned and lie between the heap and TRAPFRAME.
+int
+vma_inrange(struct proc *p, uint64 start, uint64 len)
+{
+    if(start % PGSIZE != 0 || start < PGROUNDUP(p->sz))
+        return 0;
+    if(start + len < start || start + len > TRAPFRAME)
+        return 0;
+    return 1;
+}
+
+// Can [start, start+len) be mapped as it is? It must be in
+// range and overlap no other region.
+int
+vma_fits(struct proc *p, uint64 start, uint64 len)
+{
+    return vma_inrange(p, start, len) && vma_overlap(p, start, start + len) == 0;
+}
+
+// Find the lowest free range of len bytes in the mmap area.
+// A range of 2MB or more starts on a 2MB boundary, so that its
+// anonymous pages can be megapages. Returns 0 if there is none.
+uint64
+vma_gap(struct proc *p, uint64 len)
+{
+    uint64 start = MMAPBASE, align = len >= MEGASIZE ? MEGASIZE : PGSIZE;
+
+    if(start < PGROUNDUP(p->sz))
+        start = PGROUNDUP(p->sz);
+    start = (start + align - 1) & ~(align - 1);
+
+    for(int i = 0; i < p->nvma; i++){
+        if(p->vmas[i]->vm_start >= start + len)
+            break;
+        if(p->vmas[i]->vm_end > start)
+            start = (p->vmas[i]->vm_end + align - 1) & ~(align - 1);
+    }
+    if(start + len > TRAPFRAME)
+        return 0;
+    return start;
+}
+
+// Return the PTE bits for a resident page of v. RISC-V has
+// no write-only or inaccessible leaf PTE, so write implies
+// read, and a PROT_NONE page keeps its frame in a PTE without
+// PTE_U, which user code cannot touch.
+int
+vma_perm(struct vma *v)
+{
+    int perm = PTE_V | PTE_U;
+
+    if(v->vm_prot & PROT_READ)
+        perm |= PTE_R;
+    if(v->vm_prot & PROT_WRITE)
+        perm |= PTE_R | PTE_W;
+    if(perm == (PTE_V | PTE_U))
+        perm = PTE_V | PTE_R;
+    return perm;
+}
+
+// Map every page of [start, end) of v up front, for MAP_POPULATE
+// and shared anonymous memory. None of them may be mapped yet.
+// Reads are kept in flight many blocks at a time, and the
+// PTEs are filled in one pass along each leaf page table
+// rather than walked from the root per page. Whole 2MB blocks
+// of anonymous memory that it would not map to the zero page
+// get a megapage each, when one is free.
+// Stops early if memory runs out, or if a shared file page
+// cannot be cached, leaving the rest to demand faults.
+// Returns the number of pages mapped.
+int
+vma_populate(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+    struct inode *ip = v->vm_file ? v->vm_file->ip : 0;
+    int perm = vma_perm(v), n = 0;
+    uint off, ahead = v->vm_pgoff + (start - v->vm_start);
+    uint last = v->vm_pgoff + (end - v->vm_start);
+    uint64 va;
+    pte_t *pte = 0;
+    char *pa;
+
+    // like mmap_allocate(), a writable private mapping shares
+    // the page cache's frames copy-on-write. anonymous pages are
+    // zeroed frames of their own, except that a read-only private
+    // mapping can map the zero page.
+    if((v->vm_flags & MAP_PRIVATE) && (perm & PTE_W) && ip)
+        perm = (perm & ~PTE_W) | PTE_COW;
+
+    if(ip)
+        ilock(ip);
+    for(va = start; va < end; va += PGSIZE){
+        if(ip == 0 && !v->vm_nohuge && va % MEGASIZE == 0 &&
+           va + MEGASIZE <= end && !((v->vm_flags & MAP_PRIVATE) && !(perm & PTE_W)) &&
+           megaempty(p->pagetable, va) && (pa = kalloc_order(MEGAORDER)) != 0){
+            memset(pa, 0, MEGASIZE);
+            if(mapmega(p->pagetable, va, (uint64)pa, perm) == 0){
+                __sync_fetch_and_add(&mmstat.megapages, 1);
+                n += MEGASIZE / PGSIZE;
+                va += MEGASIZE - PGSIZE;
+                pte = 0;
+                continue;
+            }
+            kfree_order(pa, MEGAORDER);
+        }
+        if(ip == 0){
+            if((v->vm_flags & MAP_PRIVATE) && !(perm & PTE_W)){
+                pa = zeropage;
+                kaddref(pa);
+            } else if((pa = kalloc_zeroed()) == 0){
+                break;
+            }
+        } else {
+            off = v->vm_pgoff + (va - v->vm_start);
+            if(ahead < off)
+                ahead = off;
+            ahead = iprefetch(ip, ahead, last - ahead);
+            if((pa = pcache_get(ip, off / PGSIZE, v->vm_flags & MAP_PRIVATE)) == 0)
+                break;
+        }
+        if(pte == 0 || PX(0, va) == 0)
+            pte = walk(p->pagetable, va, 1);
+        else
+            pte++;
+        if(pte == 0){
+            kfree(pa);
+            break;
+        }
+        if(*pte & PTE_V)
+            panic("vma_populate: remap");
+        *pte = PA2PTE(pa) | perm;
+        n++;
+    }
+    if(ip)
+        iunlock(ip);
+    return n;
+}
+
+// Write [start, end) of v back to its file. The file's own
+// offset is neither used nor moved, so read() and write() on
+// the same open file may run meanwhile.
+static void
+writerun(struct vma *v, uint64 start, uint64 end)
+{
+    writepage(v, v->vm_file, start, v->vm_pgoff + (start - v->vm_start),
+              end - start);
+}
+
+// Write back the pages of [start, end) in v that p has written,
+// as told by the hardware-maintained dirty bits, and clear them.
+// Pages that were never faulted in or only read cost nothing,
+// and neighbouring dirty pages go out together.
+static void
+vma_writeback(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+    uint64 va, run = end;
+    pte_t *pte = 0;
+
+    if(!(v->vm_flags & MAP_SHARED) || !(v->vm_prot & PROT_WRITE) ||
+       v->vm_file == 0)
+        return;
+    for(va = start; va < end; va += PGSIZE){
+        if(pte == 0 || PX(0, va) == 0)
+            pte = walk(p->pagetable, va, 0);
+        else
+            pte++;
+        if(pte && (*pte & PTE_V) && (*pte & PTE_D)){
+            *pte &= ~PTE_D;
+            if(run == end)
+                run = va;
+        } else if(run != end){
+            writerun(v, run, va);
+            run = end;
+        }
+        // no leaf table, so nothing is dirty until the next one.
+        if(pte == 0)
+            va = PXLAST(va);
+    }
+    if(run != end)
+        writerun(v, run, end);
+}
+
+// Write back and unmap the pages of [start, end), a page-aligned
+// sub-range of v. The vma itself is left for the caller to trim.
+// A megapage across either end is demoted first. Returns 0, or
+// -1 if that ran out of memory, in which case nothing changed.
+int
+vma_unmap(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+    if(start % MEGASIZE != 0 && uvmdemote(p->pagetable, start) != 0)
+        return -1;
+    if(end % MEGASIZE != 0 && uvmdemote(p->pagetable, end - PGSIZE) != 0)
+        return -1;
+    vma_writeback(p, v, start, end);
+    // uvmunmap() skips pages never faulted in, and unlike
+    // walkaddr() it also sees PROT_NONE pages, which have no PTE_U.
+    uvmunmap(p->pagetable, start, (end - start) / PGSIZE, 1);
+    return 0;
+}
+
+// Unmap every page of [start, end), a page-aligned range that
+// may span several vmas and the holes between them, or punch a
+// hole in one. Each vma is trimmed, or dropped once nothing is
+// left of it. Returns 0, or -1 if out of vmas or memory, in
+// which case nothing was unmapped.
+int
+vma_unmap_range(struct proc *p, uint64 start, uint64 end)
+{
+    struct vma *v;
+    uint64 s, e;
+
+    if((v = vma_overlap(p, start, end)) == 0)
+        return 0;
+    // unmapping the middle of a vma leaves two pieces,
+    // make sure there is a slot for the upper one first.
+    if(start > v->vm_start && end < v->vm_end){
+        if(vma_split(p, v, end) == 0)
+            return -1;
+    }
+    // so too for the megapages across the ends of the range,
+    // which become pages before anything is torn down.
+    if((start % MEGASIZE != 0 && uvmdemote(p->pagetable, start) != 0) ||
+       (end % MEGASIZE != 0 && uvmdemote(p->pagetable, end) != 0))
+        return -1;
+
+    for(; v != 0; v = vma_overlap(p, start, end)){
+        s = v->vm_start > start ? v->vm_start : start;
+        e = v->vm_end < end ? v->vm_end : end;
+        if(vma_unmap(p, v, s, e) != 0)
+            return -1;
+        if(s == v->vm_start && e == v->vm_end){
+            vma_remove(p, v);
+        } else if(s == v->vm_start){
+            v->vm_pgoff += e - v->vm_start;
+            v->vm_start = e;
+        } else {
+            v->vm_end = s;
+        }
+    }
+    return 0;
+}
+
+// Unmap every region of p and free its vmas.
+// Called by exit() and by exec() once the new image is committed.
+void
+vma_unmap_all(struct proc *p)
+{
+    struct vma *v;
+
+    while(p->nvma > 0){
+        v = p->vmas[p->nvma-1];
+        vma_unmap(p, v, v->vm_start, v->vm_end);
+        vma_remove(p, v);
+    }
+}
+
+// Give child np a copy of p's regions. The child maps the
+// parent's resident shared pages, which are page cache frames
+// or anonymous memory, directly but clean, since the parent's
+// dirty bit already owes the writeback, and shares its resident
+// private pages copy-on-write. A shared megapage is mapped whole; a
+// private one is demoted first, since copy-on-write works on
+// pages.
+// Returns 0 on success, -1 if p's table or memory ran out,
+// in which case the caller drops np's partial copy with
+// vma_free_all().
+int
+vma_fork(struct proc *p, struct proc *np)
+{
+    struct vma *v, *nv;
+    uint64 va, size;
+    pte_t *pte;
+
+    for(int i = 0; i < p->nvma; i++){
+        v = p->vmas[i];
+        if((nv = vma_insert(np, v->vm_start, v->vm_end)) == 0)
+            return -1;
+        nv->vm_flags = v->vm_flags;
+        nv->vm_prot = v->vm_prot;
+        nv->vm_pgoff = v->vm_pgoff;
+        nv->vm_fault_around = v->vm_fault_around;
+        nv->vm_advice = v->vm_advice;
+        nv->vm_nohuge = v->vm_nohuge;
+        nv->vm_file = v->vm_file ? filedup(v->vm_file) : 0;
+        for(va = v->vm_start; va < v->vm_end; va += PGSIZE){
+            if((pte = walkleaf(p->pagetable, va, &size)) == 0)
+                continue;
+            if(size == MEGASIZE && (v->vm_flags & MAP_SHARED)){
+                if(mapmega(np->pagetable, va, PTE2PA(*pte), PTE_FLAGS(*pte) & ~PTE_D) != 0)
+                    return -1;
+                kaddref_order((void*)PTE2PA(*pte), MEGAORDER);
+                va += MEGASIZE - PGSIZE;
+                continue;
+            }
+            if(size == MEGASIZE && uvmdemote(p->pagetable, va) != 0)
+                return -1;
+            if(v->vm_flags & MAP_PRIVATE){
+                if(uvmshare(p->pagetable, np->pagetable, va) != 0)
+                    return -1;
+                continue;
+            }
+            if(mappages(np->pagetable, va, PGSIZE, PTE2PA(*pte), PTE_FLAGS(*pte) & ~PTE_D) != 0)
+                return -1;
+            kaddref((void*)PTE2PA(*pte));
+        }
+    }
+    return 0;
+}
+
+// Drop np's regions without writing anything back.
+// Only used to undo a failed vma_fork(), so every file
+// reference is shared with the parent and fileclose()
+// will not sleep.
+void
+vma_free_all(struct proc *np)
+{
+    struct vma *v;
+
+    while(np->nvma > 0){
+        v = np->vmas[np->nvma-1];
+        uvmunmap(np->pagetable, v->vm_start, (v->vm_end - v->vm_start) / PGSIZE, 1);
+        vma_remove(np, v);
+    }
+}
+
+// Bring the file pages behind [start, end) of v into the page
+// cache and map the ones not mapped yet, as vma_populate() would,
+// so that touching the range takes no fault and no disk read.
+// Reads are kept in flight ahead of the page being filled.
+// Pages past the end of the file are left to demand faults.
+// Stops early if memory runs out, or for a shared mapping the
+// page cache, and points v's readahead at where it stopped so
+// that faults beyond keep reading ahead.
+static void
+vma_willneed(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+    struct inode *ip;
+    int perm = vma_perm(v);
+    uint off, ahead, last;
+    uint64 va, size;
+    char *pa;
+
+    if(v->vm_file == 0)
+        return;
+    if((v->vm_flags & MAP_PRIVATE) && (perm & PTE_W))
+        perm = (perm & ~PTE_W) | PTE_COW;
+    ip = v->vm_file->ip;
+    ilock(ip);
+    if(v->vm_pgoff >= ip->size){
+        iunlock(ip);
+        return;
+    }
+    if(end > v->vm_start + PGROUNDUP(ip->size - v->vm_pgoff))
+        end = v->vm_start + PGROUNDUP(ip->size - v->vm_pgoff);
+    ahead = v->vm_pgoff + (start - v->vm_start);
+    last = v->vm_pgoff + (end - v->vm_start);
+    for(va = start; va < end; va += PGSIZE){
+        off = v->vm_pgoff + (va - v->vm_start);
+        if(walkleaf(p->pagetable, va, &size) != 0)
+            continue;
+        if(ahead < off)
+            ahead = off;
+        ahead = iprefetch(ip, ahead, last - ahead);
+        if((pa = pcache_get(ip, off / PGSIZE, v->vm_flags & MAP_PRIVATE)) == 0)
+            break;
+        if(mappages(p->pagetable, va, PGSIZE, (uint64)pa, perm) != 0){
+            kfree(pa);
+            break;
+        }
+    }
+    iunlock(ip);
+    v->vm_ra.end = v->vm_pgoff + (va - v->vm_start);
+    v->vm_ra.ahead = ahead;
+    v->vm_ra.win = RAMAX;
+}
+
+// madvise() [start, end) of v. access pattern hints apply to
+// the range only, so v is split at its ends if they fall inside.
+// Returns -1 if a split ran out of vmas.
+int
+vma_advise(struct proc *p, struct vma *v, uint64 start, uint64 end, int advice)
+{
+    switch(advice){
+    case MADV_WILLNEED:
+        vma_willneed(p, v, start, end);
+        return 0;
+    case MADV_DONTNEED:
+        // private pages are simply dropped; the next fault
+        // reads the file again, or maps zeros. shared anonymous
+        // pages exist nowhere else, so they stay.
+        if(v->vm_file || (v->vm_flags & MAP_PRIVATE))
+            return vma_unmap(p, v, start, end);
+        return 0;
+    case MADV_HUGEPAGE:
+    case MADV_NOHUGEPAGE:
+        // only later faults see the change; megapages already
+        // mapped stay.
+        if(v->vm_nohuge == (advice == MADV_NOHUGEPAGE))
+            return 0;
+        break;
+    default:
+        if(v->vm_advice == advice)
+            return 0;
+    }
+
+    if(start > v->vm_start && (v = vma_split(p, v, start)) == 0)
+        return -1;
+    if(end < v->vm_end && vma_split(p, v, end) == 0)
+        return -1;
+    if(advice == MADV_HUGEPAGE || advice == MADV_NOHUGEPAGE){
+        v->vm_nohuge = advice == MADV_NOHUGEPAGE;
+        return 0;
+    }
+    v->vm_advice = advice;
+    memset(&v->vm_ra, 0, sizeof(v->vm_ra));
+    return 0;
+}
+
+// Change the protection of [start, end) of v to prot, splitting
+// v as needed, and rewrite the PTEs of the resident pages in
+// place, one walk per leaf page table. A private page that gains
+// write permission becomes copy-on-write unless it was writable
+// already; uvmcow() takes the frame over if nobody else maps it.
+// A megapage's one PTE is rewritten as a whole; it is only ever
+// mapped by this process if private, so it needs no copy.
+// The caller flushes the TLB. Returns 0, or -1 if out of vmas.
+int
+vma_protect(struct proc *p, struct vma *v, uint64 start, uint64 end, int prot)
+{
+    uint64 va, size;
+    pte_t *pte = 0;
+    int perm, f;
+
+    if(v->vm_prot == prot)
+        return 0;
+    if(start > v->vm_start && (v = vma_split(p, v, start)) == 0)
+        return -1;
+    if(end < v->vm_end && vma_split(p, v, end) == 0)
+        return -1;
+    // once read-only, dirty pages would no longer be written back.
+    if(!(prot & PROT_WRITE))
+        vma_writeback(p, v, start, end);
+    v->vm_prot = prot;
+    perm = vma_perm(v);
+
+    for(va = start; va < end; va += PGSIZE){
+        if(pte == 0 || PX(0, va) == 0){
+            if((pte = walk(p->pagetable, va, 0)) == 0){
+                // no leaf table, so skip to the next one,
+                // after rewriting the megapage if there is one.
+                if((pte = walkleaf(p->pagetable, va, &size)) != 0)
+                    *pte = (*pte & ~(PTE_R|PTE_W|PTE_X|PTE_U)) | perm;
+                pte = 0;
+                va = PXLAST(va);
+                continue;
+            }
+        } else {
+            pte++;
+        }
+        if((*pte & PTE_V) == 0)
+            continue;
+        f = perm;
+        if((v->vm_flags & MAP_PRIVATE) && (f & PTE_W) && !(*pte & PTE_W))
+            f = (f & ~PTE_W) | PTE_COW;
+        *pte = (*pte & ~(PTE_R|PTE_W|PTE_X|PTE_U|PTE_COW)) | f;
+    }
+    return 0;
+}
+
+// Resize v to len bytes and return its new start, or 0 on
+// failure. Shrinking unmaps the tail. Growing extends v in place
+// if the pages after it are free, or else, if maymove is set,
+// moves its PTEs to a new range without copying or refaulting.
+// The caller flushes the TLB.
+uint64
+vma_remap(struct proc *p, struct vma *v, uint64 len, int maymove)
+{
+    uint64 oldlen = v->vm_end - v->vm_start, start;
+    struct vma *nv;
+
+    if(len <= oldlen){
+        if(vma_unmap(p, v, v->vm_start + len, v->vm_end) != 0)
+            return 0;
+        v->vm_end = v->vm_start + len;
+        return v->vm_start;
+    }
+
+    start = v->vm_start;
+    if(start + len <= TRAPFRAME && vma_overlap(p, v->vm_end, start + len) == 0){
+        v->vm_end = start + len;
+        nv = v;
+    } else {
+        if(!maymove || (start = vma_gap(p, len)) == 0 ||
+           (nv = vma_insert(p, start, start + len)) == 0)
+            return 0;
+        nv->vm_flags = v->vm_flags;
+        nv->vm_prot = v->vm_prot;
+        nv->vm_pgoff = v->vm_pgoff;
+        nv->vm_fault_around = v->vm_fault_around;
+        nv->vm_advice = v->vm_advice;
+        nv->vm_nohuge = v->vm_nohuge;
+        nv->vm_ra = v->vm_ra;
+    }
+
+    // shared anonymous pages are allocated up front, as at mmap.
+    if(v->vm_file == 0 && (v->vm_flags & MAP_SHARED) &&
+       vma_populate(p, nv, start + oldlen, start + len) != (len - oldlen) / PGSIZE)
+        goto bad;
+    if(nv == v)
+        return start;
+    if(uvmmove(p->pagetable, v->vm_start, start, oldlen) < 0)
+        goto bad;
+    // the file reference moves with the pages.
+    nv->vm_file = v->vm_file;
+    v->vm_file = 0;
+    vma_remove(p, v);
+    return start;
+
+ bad:
+    vma_unmap(p, nv, start + oldlen, start + len);
+    if(nv == v)
+        v->vm_end = start + oldlen;
+    else
+        vma_remove(p, nv);
+    return 0;
+}
+
+// Queue the frame pa, holding page off of f, for msyncd.
+// Returns -1 if the queue is full.
+static int
+wbq_put(struct file *f, uint off, char *pa)
+{
+    struct wbent *e;
+
+    acquire(&wbq.lock);
+    if(wbq.n == NWBQ){
+        release(&wbq.lock);
+        return -1;
+    }
+    e = &wbq.q[(wbq.head + wbq.n) % NWBQ];
+    e->f = filedup(f);
+    e->off = off;
+    e->pa = pa;
+    kaddref(pa);
+    wbq.n++;
+    wakeup(&wbq);
+    release(&wbq.lock);
+    return 0;
+}
+
+// msync() [start, end) of v. MS_SYNC writes the dirty pages back
+// before returning, MS_ASYNC only queues them for msyncd; either
+// way they stay mapped and their dirty bits are cleared, so the
+// caller must flush the TLB.
+void
+vma_sync(struct proc *p, struct vma *v, uint64 start, uint64 end, int flags)
+{
+    uint64 va;
+    pte_t *pte;
+
+    if(!(flags & MS_ASYNC)){
+        vma_writeback(p, v, start, end);
+        return;
+    }
+    if(!(v->vm_flags & MAP_SHARED) || !(v->vm_prot & PROT_WRITE) ||
+       v->vm_file == 0)
+        return;
+    for(va = start; va < end; va += PGSIZE){
+        pte = walk(p->pagetable, va, 0);
+        if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+            continue;
+        *pte &= ~PTE_D;
+        if(wbq_put(v->vm_file, v->vm_pgoff + (va - v->vm_start),
+                   (char*)PTE2PA(*pte)) < 0)
+            writerun(v, va, va + PGSIZE);
+    }
+}
+
+// Body of the msyncd kernel process: write queued pages back,
+// taking consecutive pages of one file together so they share
+// a log transaction.
+void
+vma_flusher(void)
+{
+    struct wbent batch[WBBATCH];
+    struct inode *ip;
+    int i, n;
+    uint m;
+
+    for(;;){
+        acquire(&wbq.lock);
+        while(wbq.n == 0)
+            sleep(&wbq, &wbq.lock);
+        n = 0;
+        do {
+            batch[n++] = wbq.q[wbq.head];
+            wbq.head = (wbq.head + 1) % NWBQ;
+            wbq.n--;
+        } while(n < WBBATCH && wbq.n > 0 &&
+                wbq.q[wbq.head].f->ip == batch[0].f->ip &&
+                wbq.q[wbq.head].off == batch[n-1].off + PGSIZE);
+        release(&wbq.lock);
+
+        // like writepage(), never extend the file.
+        ip = batch[0].f->ip;
+        begin_op();
+        ilock(ip);
+        for(i = 0; i < n; i++){
+            if(batch[i].off >= ip->size)
+                continue;
+            m = ip->size - batch[i].off;
+            if(m > PGSIZE)
+                m = PGSIZE;
+            writei(ip, 0, (uint64)batch[i].pa, batch[i].off, m);
+        }
+        iunlock(ip);
+        end_op();
+
+        for(i = 0; i < n; i++){
+            kfree(batch[i].pa);
+            fileclose(batch[i].f);
+        }
+    }
+}
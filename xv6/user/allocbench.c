@@ -0,0 +1,84 @@
+//
+// allocbench: kalloc()/kfree() throughput from 1 to n processes.
+//
+// Each worker grows its heap by NPAGES pages, touches every page,
+// which allocates it in the fault handler, and shrinks the heap
+// again, which frees them, ROUNDS times over. With as many
+// workers as harts and nothing shared between them, the ticks
+// for each run should stay flat as workers are added; a shared
+// allocator lock makes them grow instead.
+//
+// usage: allocbench [n], where n defaults to 3, the Makefile's
+// default CPUS; pass the CPUS QEMU was started with.
+//
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NPAGES 64
+#define ROUNDS 200
+
+void
+worker(void)
+{
+  int r, i;
+  char *p;
+
+  for(r = 0; r < ROUNDS; r++){
+    if((p = sbrk(NPAGES*PGSIZE)) == (char*)-1){
+      printf("allocbench: sbrk failed\n");
+      exit(1);
+    }
+    for(i = 0; i < NPAGES; i++)
+      p[i*PGSIZE] = r;
+    sbrk(-NPAGES*PGSIZE);
+  }
+  exit(0);
+}
+
+// run n workers at once and return the ticks until the last exits.
+int
+run(int n)
+{
+  int i, pid, status, t;
+
+  t = uptime();
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0){
+      printf("allocbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      worker();
+  }
+  for(i = 0; i < n; i++){
+    wait(&status);
+    if(status != 0)
+      exit(1);
+  }
+  return uptime() - t;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n = 3, i, t;
+
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n < 1 || n > NCPU){
+    printf("usage: allocbench [1-%d]\n", NCPU);
+    exit(1);
+  }
+  printf("allocbench: %d pages allocated and freed %d times per worker\n",
+         NPAGES, ROUNDS);
+  for(i = 1; i <= n; i++){
+    t = run(i);
+    printf("%d workers: %d ticks, %d pages/tick\n", i, t,
+           t ? i*NPAGES*ROUNDS / t : 0);
+  }
+  exit(0);
+}
@@ -0,0 +1,70 @@
+//
+// forkbench: fork/exit throughput.
+//
+// Times NFORK rounds of fork, exit in the child and wait in the
+// parent, first as they are and then with the child writing one
+// byte to each of NPAGES heap pages, so that every round also
+// copies and frees NPAGES copy-on-write pages. Build the kernel
+// with and without KDEBUG to see what the allocator's debug
+// fills cost:
+//
+//   make qemu              no fills
+//   make KDEBUG=1 qemu     junk on every kalloc() and kfree()
+//   make KDEBUG=2 qemu     a canary word per page
+//
+// (changing KDEBUG rebuilds kalloc.o, so no make clean is
+// needed between them.)
+//
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NFORK 500
+#define NPAGES 16
+
+char *heap;
+
+void
+run(char *name, int npages)
+{
+  int i, j, pid, status, t;
+
+  t = uptime();
+  for(i = 0; i < NFORK; i++){
+    if((pid = fork()) < 0){
+      printf("forkbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < npages; j++)
+        heap[j*PGSIZE] = j;
+      exit(0);
+    }
+    wait(&status);
+    if(status != 0)
+      exit(1);
+  }
+  t = uptime() - t;
+  printf("%s: %d rounds in %d ticks, %d rounds/tick\n", name, NFORK, t,
+         t ? NFORK / t : NFORK);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int j;
+
+  if((heap = sbrk(NPAGES*PGSIZE)) == (char*)-1){
+    printf("forkbench: sbrk failed\n");
+    exit(1);
+  }
+  for(j = 0; j < NPAGES; j++)
+    heap[j*PGSIZE] = 0;
+  printf("forkbench starting\n");
+  run("fork/exit", 0);
+  run("fork/write/exit", NPAGES);
+  exit(0);
+}
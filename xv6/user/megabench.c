@@ -0,0 +1,73 @@
+//
+// megabench: time page-stride passes over anonymous memory
+// mapped with 2MB megapages and with 4K pages.
+//
+// Each run maps NMB megabytes, touches every page once, then
+// reads one byte per page PASSES times. It reports the faults
+// the first touch took, the megapages it got, the TLB entries
+// needed to cover the region, and the ticks the passes took.
+// With pages every pass touches more pages than the TLB holds,
+// so every access misses; with megapages a pass needs a handful
+// of entries. QEMU counts no TLB misses, so the entries needed
+// stand in for them and the ticks show what they cost.
+//
+
+#include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/mmapstat.h"
+#include "user/user.h"
+
+#define NMB 8
+#define PASSES 200
+#define MAP_FAILED ((char *) -1)
+
+void
+run(char *name, int advice)
+{
+  struct mmapstat before, after;
+  int i, pass, t;
+  uint64 len = NMB * 1024 * 1024, megapages;
+  volatile char c;
+  char *p;
+
+  p = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED){
+    printf("megabench: mmap failed\n");
+    exit(1);
+  }
+  if(advice >= 0 && madvise(p, len, advice) < 0){
+    printf("megabench: madvise failed\n");
+    exit(1);
+  }
+
+  mmapstat(&before);
+  for(i = 0; i < len / PGSIZE; i++)
+    p[i*PGSIZE] = i;
+  mmapstat(&after);
+  megapages = after.megapages - before.megapages;
+
+  t = uptime();
+  for(pass = 0; pass < PASSES; pass++)
+    for(i = 0; i < len / PGSIZE; i++)
+      c = p[i*PGSIZE];
+  t = uptime() - t;
+  (void)c;
+
+  printf("%s: %d pages, %d faults, %d megapages\n", name, (int)(len / PGSIZE),
+         (int)(after.faults - before.faults), (int)megapages);
+  printf("  TLB entries per pass %d, %d passes in %d ticks\n",
+         (int)(megapages + (len - megapages*MEGASIZE) / PGSIZE), PASSES, t);
+  munmap(p, len);
+}
+
+int
+main(int argc, char *argv[])
+{
+  printf("megabench starting\n");
+  run("4K pages", MADV_NOHUGEPAGE);
+  run("2MB megapages", -1);
+  exit(0);
+}
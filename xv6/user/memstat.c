@@ -0,0 +1,40 @@
+//
+// memstat: print the free blocks of each order in the physical
+// page allocator, and how fragmented free memory is.
+//
+// For each order k, "unusable" is the share of free memory held
+// in blocks smaller than 2^k pages, which an allocation of order
+// k cannot use: 0% means every free page could serve it, 100%
+// that none could.
+//
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/kmemstat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct kmemstat st;
+  uint64 free = 0, small = 0;
+  int k;
+
+  if(kmemstat(&st) < 0){
+    printf("memstat: kmemstat failed\n");
+    exit(1);
+  }
+  for(k = 0; k <= MAXORDER; k++)
+    free += st.nfree[k] << k;
+  printf("%d free pages, plus %d cached by the CPUs\n", (int)free, (int)st.cached);
+  printf("order   blocks  unusable  failed\n");
+  for(k = 0; k <= MAXORDER; k++){
+    printf("%d\t%d\t%d%%\t  %d\n", k, (int)st.nfree[k],
+           free ? (int)(small * 100 / free) : 0, (int)st.failed[k]);
+    small += st.nfree[k] << k;
+  }
+  printf("%d pages zeroed ahead, %d zeroed allocations hit, %d missed\n",
+         (int)st.zeroed, (int)st.zero_hits, (int)st.zero_misses);
+  exit(0);
+}
@@ -0,0 +1,109 @@
+//
+// mmapbench: time sequential scans of a mapped file.
+//
+// Each run maps the file, reads one byte per page from start to
+// end, and reports the page faults taken, the pages those faults
+// mapped, the elapsed ticks, and the kernel's time in faults and
+// in MAP_POPULATE (r_time() units, from mmapstat()).
+//
+
+#include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/mmapstat.h"
+#include "user/user.h"
+
+#define NPAGES 48
+#define MAP_FAILED ((char *) -1)
+
+char *fname = "mmapbench.tmp";
+char buf[PGSIZE];
+
+void
+makefile(void)
+{
+  int fd, i;
+
+  unlink(fname);
+  if((fd = open(fname, O_WRONLY | O_CREATE)) < 0){
+    printf("mmapbench: create %s failed\n", fname);
+    exit(1);
+  }
+  for(i = 0; i < NPAGES; i++){
+    memset(buf, 'a' + i % 26, PGSIZE);
+    if(write(fd, buf, PGSIZE) != PGSIZE){
+      printf("mmapbench: write %s failed\n", fname);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+// map the file with the extra mmap flags, set its fault-around
+// to npages (-1 keeps the default), touch every page, and print
+// what it cost.
+void
+scan(char *name, int flags, int npages)
+{
+  struct mmapstat before, after;
+  int fd, i, t;
+  char *p;
+  volatile char c;
+
+  if((fd = open(fname, O_RDONLY)) < 0){
+    printf("mmapbench: open %s failed\n", fname);
+    exit(1);
+  }
+  mmapstat(&before);
+  t = uptime();
+  p = mmap(0, NPAGES*PGSIZE, PROT_READ, MAP_SHARED | flags, fd, 0);
+  if(p == MAP_FAILED){
+    printf("mmapbench: mmap failed\n");
+    exit(1);
+  }
+  close(fd);
+  if(npages >= 0 && faultaround(p, npages) < 0){
+    printf("mmapbench: faultaround failed\n");
+    exit(1);
+  }
+
+  for(i = 0; i < NPAGES; i++){
+    c = p[i*PGSIZE];
+    if(c != 'a' + i % 26){
+      printf("mmapbench: %s: wrong byte at page %d\n", name, i);
+      exit(1);
+    }
+  }
+  t = uptime() - t;
+  mmapstat(&after);
+
+  printf("%s: %d pages, %d faults, %d mapped, %d ticks\n", name, NPAGES,
+         (int)(after.faults - before.faults),
+         (int)(after.mapped - before.mapped), t);
+  printf("  fault time %d, populated %d, populate time %d\n",
+         (int)(after.fault_time - before.fault_time),
+         (int)(after.populated - before.populated),
+         (int)(after.populate_time - before.populate_time));
+  munmap(p, NPAGES*PGSIZE);
+}
+
+int
+main(int argc, char *argv[])
+{
+  printf("mmapbench starting\n");
+  makefile();
+
+  // the first scan fills the page cache for the others.
+  scan("cold", 0, 0);
+  scan("warm, no fault-around", 0, 0);
+  scan("warm, fault-around 16", 0, 16);
+
+  // a new file starts with nothing cached.
+  makefile();
+  scan("cold, MAP_POPULATE", MAP_POPULATE, -1);
+  scan("warm, MAP_POPULATE", MAP_POPULATE, -1);
+  unlink(fname);
+  exit(0);
+}
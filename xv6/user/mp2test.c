@@ -4,10 +4,24 @@
 #include "kernel/stat.h"
 #include "kernel/riscv.h"
 #include "kernel/fs.h"
+#include "kernel/mmapstat.h"
+#include "kernel/uio.h"
 #include "user/user.h"
 
 int syscall_test();
 int fork_test();
+int msync_test();
+int madvise_test();
+int populate_test();
+int placement_test();
+int cow_test();
+int lazy_test();
+int anon_test();
+int mprotect_test();
+int mremap_test();
+int munmap_test();
+int pio_test();
+int mega_test();
 char buf[BSIZE];
 
 #define MAP_FAILED ((char *) -1)
@@ -16,7 +30,10 @@ int
 main(int argc, char *argv[])
 {
   printf("mp2test starting\n");
-  if (syscall_test() && fork_test())
+  if (syscall_test() && fork_test() && msync_test() && madvise_test() &&
+      populate_test() && placement_test() && cow_test() &&
+      lazy_test() && anon_test() && mprotect_test() &&
+      mremap_test() && munmap_test() && pio_test() && mega_test())
     printf("mp2test: all tests succeeded\n");
   exit(0);
 }
@@ -286,3 +303,870 @@ fork_test(void)
   return 1;
 }
 
+
+//
+// write through a shared mapping, msync it, and check that
+// the file has the data while the mapping stays usable.
+//
+int
+msync_test(void)
+{
+  int fd, i;
+  char b;
+  const char * const f = "mmap.dur";
+
+  testname = "msync";
+  printf("test msync\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  char *p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (6)");
+
+  for (i = 0; i < PGSIZE; i++)
+    p[i] = 'S';
+  if (msync(p, PGSIZE*2, MS_SYNC) == -1)
+    err("msync (1)");
+  for (i = 0; i < PGSIZE; i++){
+    if (read(fd, &b, 1) != 1)
+      err("read (2)");
+    if (b != 'S')
+      err("file does not contain msync'ed data");
+  }
+
+  // the mapping is still there after msync.
+  for (i = PGSIZE; i < PGSIZE + PGSIZE/2; i++)
+    if (p[i] != 'A')
+      err("mapping changed by msync");
+  if (msync(p, PGSIZE, MS_ASYNC) == -1)
+    err("msync (2)");
+  if (msync(p, PGSIZE, MS_SYNC | MS_ASYNC) != -1)
+    err("msync with both flags should have failed");
+  if (msync(p, -PGSIZE, MS_SYNC) != -1)
+    err("msync of a wrapping range should have failed");
+
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (5)");
+  if (close(fd) == -1)
+    err("close");
+
+  printf("test msync: PASS\n");
+  return 1;
+}
+
+int
+madvise_test(void)
+{
+  int fd, i;
+  char b;
+  struct mmapstat before, after;
+  const char * const f = "mmap.dur";
+  const char * const g = "mmap.big";
+
+  testname = "madvise";
+  printf("test madvise\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  char *p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (7)");
+  char *q = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (q == MAP_FAILED)
+    err("mmap (8)");
+
+  // hints on part of a mapping must leave its contents alone.
+  if (madvise(p, PGSIZE, MADV_SEQUENTIAL) == -1)
+    err("madvise (1)");
+  if (madvise(p + PGSIZE, PGSIZE, MADV_RANDOM) == -1)
+    err("madvise (2)");
+  if (madvise(q, PGSIZE*2, MADV_WILLNEED) == -1)
+    err("madvise (3)");
+  _v1(p);
+  if (madvise(p, PGSIZE*2, MADV_NORMAL) == -1)
+    err("madvise (4)");
+  if (madvise(p, PGSIZE, 99) != -1)
+    err("madvise with bad advice should have failed");
+  if (madvise(p, -PGSIZE, MADV_NORMAL) != -1)
+    err("madvise of a wrapping range should have failed");
+
+  // DONTNEED writes back dirty shared pages, and throws away
+  // private ones so they read the file again.
+  for (i = 0; i < PGSIZE; i++)
+    p[i] = 'D';
+  for (i = 0; i < PGSIZE; i++)
+    q[i] = 'P';
+  if (madvise(p, PGSIZE*2, MADV_DONTNEED) == -1)
+    err("madvise (5)");
+  if (madvise(q, PGSIZE*2, MADV_DONTNEED) == -1)
+    err("madvise (6)");
+  for (i = 0; i < PGSIZE; i++){
+    if (read(fd, &b, 1) != 1)
+      err("read (3)");
+    if (b != 'D')
+      err("file does not contain DONTNEED'ed data");
+  }
+  for (i = 0; i < PGSIZE; i++)
+    if (p[i] != 'D' || q[i] != 'D')
+      err("mapping lost data after DONTNEED");
+
+  // the hints split p in two.
+  if (munmap(p, PGSIZE) == -1 || munmap(p + PGSIZE, PGSIZE) == -1)
+    err("munmap (6)");
+  if (madvise(p, PGSIZE, MADV_NORMAL) != -1)
+    err("madvise of unmapped memory should have failed");
+  if (munmap(q, PGSIZE*2) == -1)
+    err("munmap (7)");
+  if (close(fd) == -1)
+    err("close");
+
+  // WILLNEED reads in the whole range, well past the readahead
+  // window, so scanning it afterwards reads nothing from disk.
+  unlink(g);
+  if ((fd = open(g, O_CREATE | O_RDWR)) == -1)
+    err("open");
+  memset(buf, 'W', BSIZE);
+  for (i = 0; i < 16*PGSIZE/BSIZE; i++)
+    if (write(fd, buf, BSIZE) != BSIZE)
+      err("write");
+  p = mmap(0, PGSIZE*16, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap of big file");
+  if (madvise(p, PGSIZE*16, MADV_WILLNEED) == -1)
+    err("madvise (7)");
+  if (mmapstat(&before) == -1)
+    err("mmapstat (1)");
+  for (i = 0; i < PGSIZE*16; i += BSIZE)
+    if (p[i] != 'W')
+      err("WILLNEED mapping mismatch");
+  if (mmapstat(&after) == -1)
+    err("mmapstat (2)");
+  if (after.misses != before.misses)
+    err("scan after WILLNEED missed the page cache");
+  if (after.faults != before.faults)
+    err("scan after WILLNEED took a page fault");
+  if (munmap(p, PGSIZE*16) == -1)
+    err("munmap of big file");
+  if (close(fd) == -1)
+    err("close");
+  unlink(g);
+
+  printf("test madvise: PASS\n");
+  return 1;
+}
+
+int
+populate_test(void)
+{
+  int fd;
+  struct mmapstat before, after;
+  const char * const f = "mmap.dur";
+
+  testname = "populate";
+  printf("test MAP_POPULATE\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (mmapstat(&before) == -1)
+    err("mmapstat (1)");
+  char *p = mmap(0, PGSIZE*2, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (9)");
+  _v1(p);
+  if (mmapstat(&after) == -1)
+    err("mmapstat (2)");
+  if (after.populated - before.populated != 2)
+    err("MAP_POPULATE did not map every page");
+  if (after.faults != before.faults)
+    err("populated mapping took a page fault");
+
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (8)");
+  if (close(fd) == -1)
+    err("close");
+
+  printf("test MAP_POPULATE: PASS\n");
+  return 1;
+}
+
+int
+placement_test(void)
+{
+  int fd, i;
+  const char * const f = "mmap.dur";
+
+  testname = "mmap offset";
+  printf("test mmap offset\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+
+  // the second page of the file: half 'A', half zeros.
+  char *p = mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, PGSIZE);
+  if (p == MAP_FAILED)
+    err("mmap (10)");
+  for (i = 0; i < PGSIZE; i++)
+    if (p[i] != (i < PGSIZE/2 ? 'A' : 0))
+      err("wrong data at offset");
+  if (munmap(p, PGSIZE) == -1)
+    err("munmap (9)");
+  if (mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, 100) != MAP_FAILED)
+    err("mmap at an unaligned offset should have failed");
+
+  printf("test mmap offset: PASS\n");
+
+  testname = "mmap fixed";
+  printf("test mmap fixed\n");
+
+  // a free address is used as given, whether fixed or a hint.
+  char *q = p + 8*PGSIZE;
+  if (mmap(q, PGSIZE*2, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != q)
+    err("mmap (11)");
+  _v1(q);
+  // a fixed mapping over an old one replaces its pages.
+  if (mmap(q + PGSIZE, PGSIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != q + PGSIZE)
+    err("overlapping MAP_FIXED");
+  for (i = 0; i < PGSIZE; i++)
+    if (q[PGSIZE + i] != 0)
+      err("MAP_FIXED did not replace the old pages");
+  if (q[0] != 'A')
+    err("MAP_FIXED changed the pages next to it");
+  if (mmap(q + 1, PGSIZE, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED)
+    err("unaligned MAP_FIXED should have failed");
+  if (mmap(q + 2*PGSIZE, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0) != q + 2*PGSIZE)
+    err("free hint address was not used");
+
+  // a hint that is taken goes elsewhere.
+  char *r = mmap(q, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (r == MAP_FAILED || r == q)
+    err("mmap (12)");
+
+  // the heap cannot grow over a mapping.
+  char *h = (char *) PGROUNDUP((uint64) sbrk(0)) + PGSIZE;
+  if (mmap(h, PGSIZE, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != h)
+    err("mmap (13)");
+  if (sbrk(PGSIZE*3) != (char *) -1)
+    err("sbrk into a mapping should have failed");
+
+  if (munmap(q, PGSIZE*2) == -1 || munmap(q + 2*PGSIZE, PGSIZE) == -1)
+    err("munmap (10)");
+  if (munmap(r, PGSIZE) == -1)
+    err("munmap (11)");
+  if (munmap(h, PGSIZE) == -1)
+    err("munmap (12)");
+  if (close(fd) == -1)
+    err("close");
+
+  printf("test mmap fixed: PASS\n");
+  return 1;
+}
+
+int
+cow_test(void)
+{
+  int fd, pid, i;
+  int status = -1;
+  const char * const f = "mmap.dur";
+
+  testname = "copy-on-write fork";
+  printf("test copy-on-write fork\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  char *p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (14)");
+  p[0] = 'P';                   // a private copy before the fork
+  if (p[PGSIZE] != 'A')         // still the page cache's frame
+    err("cow mismatch (1)");
+  buf[0] = 'P';
+  buf[1] = 'x';
+
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    if (p[0] != 'P' || buf[0] != 'P')
+      err("child does not see the parent's data");
+    p[0] = 'C';
+    p[PGSIZE] = 'C';
+    buf[0] = 'C';
+    // the kernel writes through copyout() must copy too.
+    if (read(fd, buf + 1, 1) != 1 || buf[1] != 'A')
+      err("read into a copy-on-write page");
+    exit(0);
+  }
+  wait(&status);
+  if (status != 0)
+    err("child failed");
+
+  // the child's writes stayed in the child.
+  if (p[0] != 'P' || p[PGSIZE] != 'A' || buf[0] != 'P' || buf[1] != 'x')
+    err("parent sees the child's writes");
+  for (i = 1; i < PGSIZE; i++)
+    if (p[i] != 'A')
+      err("cow mismatch (2)");
+
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (13)");
+  if (close(fd) == -1)
+    err("close");
+
+  printf("test copy-on-write fork: PASS\n");
+  return 1;
+}
+
+int
+lazy_test(void)
+{
+  int fd;
+  char *old, *h;
+  const char * const f = "mmap.dur";
+
+  testname = "lazy sbrk";
+  printf("test lazy sbrk\n");
+
+  // far more than the machine has; only touched pages are allocated.
+  old = sbrk(0);
+  if ((h = sbrk(1024*1024*1024)) == (char *) -1)
+    err("sbrk (1)");
+  if (h[0] != 0 || h[512*1024*1024] != 0)
+    err("new heap is not zeroed");
+  h[0] = 'H';
+  h[512*1024*1024] = 'H';
+
+  // system calls can copy into untouched heap pages.
+  makefile(f);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd, h + 256*1024*1024, PGSIZE) != PGSIZE)
+    err("read into the lazy heap");
+  if (h[256*1024*1024] != 'A' || h[0] != 'H')
+    err("lazy heap mismatch");
+  if (close(fd) == -1)
+    err("close");
+
+  if (sbrk(-(1024*1024*1024)) == (char *) -1 || sbrk(0) != old)
+    err("sbrk (2)");
+
+  printf("test lazy sbrk: PASS\n");
+  return 1;
+}
+
+int
+anon_test(void)
+{
+  int pid, i;
+  int status = -1;
+  char *p, *s;
+
+  testname = "anonymous mmap";
+  printf("test anonymous mmap\n");
+
+  if (mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0) != MAP_FAILED)
+    err("mmap with a file and MAP_ANONYMOUS");
+  if (mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, PGSIZE) != MAP_FAILED)
+    err("mmap with an offset and MAP_ANONYMOUS");
+
+  p = mmap(0, PGSIZE*4, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap (15)");
+  s = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (s == MAP_FAILED)
+    err("mmap (16)");
+  for (i = 0; i < PGSIZE*4; i += 512)
+    if (p[i] != 0)
+      err("private anonymous memory is not zeroed");
+  for (i = 0; i < PGSIZE*2; i += 512)
+    if (s[i] != 0)
+      err("shared anonymous memory is not zeroed");
+  p[0] = 'P';
+  s[0] = 'S';
+  if (p[PGSIZE] != 0 || p[1] != 0)
+    err("anonymous mismatch (1)");
+
+  // the child shares s but has its own copy of p.
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    if (p[0] != 'P' || s[0] != 'S')
+      err("child does not see the parent's data");
+    p[0] = 'C';
+    p[PGSIZE*2] = 'C';
+    s[0] = 'C';
+    s[PGSIZE] = 'C';
+    exit(0);
+  }
+  wait(&status);
+  if (status != 0)
+    err("child failed");
+  if (p[0] != 'P' || p[PGSIZE*2] != 0)
+    err("parent sees the child's private writes");
+  if (s[0] != 'C' || s[PGSIZE] != 'C')
+    err("parent does not see the child's shared writes");
+
+  if (munmap(p, PGSIZE*4) == -1)
+    err("munmap (14)");
+  if (munmap(s, PGSIZE*2) == -1)
+    err("munmap (15)");
+
+  // the frames went back at munmap, so this does not run out.
+  for (i = 0; i < 64; i++) {
+    p = mmap(0, PGSIZE*64, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      err("mmap (17)");
+    p[PGSIZE*63] = 'X';
+    if (munmap(p, PGSIZE*64) == -1)
+      err("munmap (16)");
+  }
+
+  printf("test anonymous mmap: PASS\n");
+  return 1;
+}
+
+// run f(p) in a child and return its exit status.
+int
+child_status(void (*f)(char *), char *p)
+{
+  int pid, status = 0;
+
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    f(p);
+    exit(0);
+  }
+  wait(&status);
+  return status;
+}
+
+void
+poke(char *p)
+{
+  *p = 'W';
+}
+
+void
+peek(char *p)
+{
+  volatile char c = *p;
+  (void)c;
+}
+
+int
+mprotect_test(void)
+{
+  int fd;
+  char *p;
+  const char * const f = "mmap.dur";
+
+  testname = "mprotect";
+  printf("test mprotect\n");
+
+  p = mmap(0, PGSIZE*3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap (18)");
+  p[0] = 'a';
+  p[PGSIZE] = 'b';
+  p[PGSIZE*2] = 'c';
+
+  // a read-only page in the middle; its neighbours stay writable.
+  if (mprotect(p + PGSIZE, PGSIZE, PROT_READ) == -1)
+    err("mprotect (1)");
+  if (child_status(poke, p + PGSIZE) == 0)
+    err("write to a read-only page");
+  if (child_status(poke, p) != 0 || child_status(poke, p + PGSIZE*2) != 0)
+    err("write next to a read-only page");
+  if (p[PGSIZE] != 'b')
+    err("mprotect lost data (1)");
+
+  // a guard page can be neither read nor written.
+  if (mprotect(p + PGSIZE, PGSIZE, PROT_NONE) == -1)
+    err("mprotect (2)");
+  if (child_status(peek, p + PGSIZE) == 0)
+    err("read of a PROT_NONE page");
+
+  // writable again, with the old contents.
+  if (mprotect(p, PGSIZE*3, PROT_READ | PROT_WRITE) == -1)
+    err("mprotect (3)");
+  if (p[PGSIZE] != 'b')
+    err("mprotect lost data (2)");
+  p[PGSIZE] = 'B';
+  if (p[0] != 'a' || p[PGSIZE] != 'B' || p[PGSIZE*2] != 'c')
+    err("mprotect mismatch");
+  if (mprotect(p + PGSIZE*2, PGSIZE*2, PROT_READ) != -1)
+    err("mprotect past the end of a mapping");
+  if (mprotect(p, -PGSIZE, PROT_READ) != -1)
+    err("mprotect of a wrapping range");
+  if (munmap(p, PGSIZE*3) == -1)
+    err("munmap (17)");
+
+  // a shared mapping of a read-only file cannot become writable.
+  makefile(f);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (19)");
+  if (mprotect(p, PGSIZE, PROT_READ | PROT_WRITE) != -1)
+    err("mprotect of a read-only file");
+  if (munmap(p, PGSIZE) == -1)
+    err("munmap (18)");
+  if (close(fd) == -1)
+    err("close");
+
+  // munmap frees a PROT_NONE page too, so it can be mapped again.
+  p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap of a guard page");
+  p[0] = 'x';
+  if (mprotect(p, PGSIZE, PROT_NONE) == -1 || munmap(p, PGSIZE) == -1)
+    err("munmap of a PROT_NONE page");
+  if (mmap(p, PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != p)
+    err("mmap over a freed guard page");
+  if (p[0] != 0)
+    err("old guard page contents");
+  if (munmap(p, PGSIZE) == -1)
+    err("munmap of a guard page");
+
+  // a dirty shared page is written back before it turns read-only.
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap of a shared page");
+  p[0] = 'Z';
+  if (mprotect(p, PGSIZE, PROT_READ) == -1)
+    err("mprotect to read-only");
+  if (munmap(p, PGSIZE) == -1)
+    err("munmap of a shared page");
+  if (read(fd, buf, 1) != 1 || buf[0] != 'Z')
+    err("dirty page lost by mprotect");
+  if (close(fd) == -1)
+    err("close");
+
+  printf("test mprotect: PASS\n");
+  return 1;
+}
+
+int
+mremap_test(void)
+{
+  int fd, i;
+  char *p, *q, *np;
+  struct mmapstat before, after;
+  const char * const f = "mmap.dur";
+
+  testname = "mremap";
+  printf("test mremap\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*2, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (20)");
+  if (p[0] != 'A' || p[PGSIZE] != 'A')
+    err("mremap mismatch (1)");
+  // something right after p, so that it cannot grow in place.
+  q = mmap(p + PGSIZE*2, PGSIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  if (q != p + PGSIZE*2)
+    err("mmap (21)");
+
+  // the file grows by 1.5 pages of 'B'.
+  while ((i = read(fd, buf, BSIZE)) > 0)
+    ;
+  if (i < 0)
+    err("read");
+  memset(buf, 'B', BSIZE);
+  for (i = 0; i < PGSIZE*3/2/BSIZE; i++)
+    if (write(fd, buf, BSIZE) != BSIZE)
+      err("write");
+
+  if (mremap(p, PGSIZE*2, PGSIZE*3, 0) != MAP_FAILED)
+    err("mremap into another mapping");
+  mmapstat(&before);
+  if ((np = mremap(p, PGSIZE*2, PGSIZE*3, MREMAP_MAYMOVE)) == MAP_FAILED)
+    err("mremap (1)");
+  if (np == p)
+    err("mremap did not move");
+  // the resident pages came along without faulting.
+  if (np[0] != 'A' || np[PGSIZE] != 'A' || np[PGSIZE + PGSIZE/2] != 'B')
+    err("mremap mismatch (2)");
+  mmapstat(&after);
+  if (after.faults != before.faults)
+    err("moved pages faulted again");
+  if (np[PGSIZE*2] != 'B')
+    err("mremap mismatch (3)");
+  if (child_status(peek, p) == 0)
+    err("read of the old range");
+
+  // shrink, then grow back in place.
+  if (mremap(np, PGSIZE*3, PGSIZE, 0) != np)
+    err("mremap (2)");
+  if (child_status(peek, np + PGSIZE) == 0)
+    err("read past a shrunk mapping");
+  if (mremap(np, PGSIZE, PGSIZE*2, 0) != np)
+    err("mremap (3)");
+  if (np[0] != 'A' || np[PGSIZE] != 'A')
+    err("mremap mismatch (4)");
+
+  if (munmap(np, PGSIZE*2) == -1)
+    err("munmap (19)");
+  if (munmap(q, PGSIZE) == -1)
+    err("munmap (20)");
+  if (close(fd) == -1)
+    err("close");
+
+  printf("test mremap: PASS\n");
+  return 1;
+}
+
+int
+munmap_test(void)
+{
+  int fd, i;
+  char *p, *q;
+  const char * const f = "mmap.dur";
+
+  testname = "munmap ranges";
+  printf("test munmap ranges\n");
+
+  // punch a hole in the middle of a mapping.
+  p = mmap(0, PGSIZE*4, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap (22)");
+  for (i = 0; i < 4; i++)
+    p[i*PGSIZE] = '0' + i;
+  if (munmap(p + PGSIZE, PGSIZE) == -1)
+    err("munmap (21)");
+  if (child_status(peek, p + PGSIZE) == 0)
+    err("read of an unmapped hole");
+  if (p[0] != '0' || p[PGSIZE*2] != '2' || p[PGSIZE*3] != '3')
+    err("munmap lost data");
+
+  // one call over two pieces, the hole, and a second mapping.
+  q = mmap(p + PGSIZE*4, PGSIZE*2, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  if (q != p + PGSIZE*4)
+    err("mmap (23)");
+  q[0] = 'q';
+  if (munmap(p, PGSIZE*6) == -1)
+    err("munmap (22)");
+  for (i = 0; i < 6; i++)
+    if (child_status(peek, p + i*PGSIZE) == 0)
+      err("read after munmap");
+  if (munmap(p, PGSIZE*6) != -1)
+    err("munmap of nothing");
+
+  // a big mapping goes in one call.
+  p = mmap(0, PGSIZE*1000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap (24)");
+  for (i = 0; i < 1000; i++)
+    p[i*PGSIZE] = 'x';
+  if (munmap(p, PGSIZE*1000) == -1)
+    err("munmap (23)");
+
+  // dirty pages of every piece are written back.
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (25)");
+  p[0] = 'Z';
+  p[PGSIZE] = 'Z';
+  if (mprotect(p + PGSIZE, PGSIZE, PROT_READ) == -1)
+    err("mprotect");
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (24)");
+  if (read(fd, buf, BSIZE) != BSIZE || buf[0] != 'Z')
+    err("first page not written back");
+  for (i = 1; i < PGSIZE/BSIZE; i++)
+    if (read(fd, buf, BSIZE) != BSIZE)
+      err("read");
+  if (read(fd, buf, 1) != 1 || buf[0] != 'Z')
+    err("second page not written back");
+  if (close(fd) == -1)
+    err("close");
+
+  printf("test munmap ranges: PASS\n");
+  return 1;
+}
+
+int
+pio_test(void)
+{
+  int fd;
+  char a[8], b[8];
+  struct iovec iov[2];
+  const char * const f = "mmap.dur";
+  const char * const g = "mmap.iov";
+
+  testname = "pread/pwrite/readv/writev";
+  printf("test pread/pwrite/readv/writev\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  if (pwrite(fd, "xyz", 3, 100) != 3)
+    err("pwrite");
+  if (pread(fd, a, 3, 99) != 3 || memcmp(a, "Axy", 3) != 0)
+    err("pread");
+  if (pread(fd, a, 8, PGSIZE + PGSIZE/2 - 2) != 2)
+    err("pread at the end");
+  // neither moved the file offset.
+  if (read(fd, a, 1) != 1 || a[0] != 'A')
+    err("offset moved");
+  if (close(fd) == -1)
+    err("close");
+
+  unlink(g);
+  if ((fd = open(g, O_CREATE | O_RDWR)) == -1)
+    err("open");
+  iov[0].iov_base = "hello ";
+  iov[0].iov_len = 6;
+  iov[1].iov_base = "world";
+  iov[1].iov_len = 5;
+  if (writev(fd, iov, 2) != 11)
+    err("writev");
+  if (close(fd) == -1)
+    err("close");
+
+  if ((fd = open(g, O_RDONLY)) == -1)
+    err("open");
+  iov[0].iov_base = a;
+  iov[0].iov_len = 5;
+  iov[1].iov_base = b;
+  iov[1].iov_len = 8;
+  if (readv(fd, iov, 2) != 11)
+    err("readv");
+  if (memcmp(a, "hello", 5) != 0 || memcmp(b, " world", 6) != 0)
+    err("readv mismatch");
+  if (close(fd) == -1)
+    err("close");
+
+  // a bad piece stops writev, which still reports what it wrote.
+  if ((fd = open(g, O_RDWR)) == -1)
+    err("open");
+  iov[0].iov_base = "HELLO";
+  iov[0].iov_len = 5;
+  iov[1].iov_base = (void *) (MAXVA - PGSIZE);
+  iov[1].iov_len = 5;
+  if (writev(fd, iov, 2) != 5)
+    err("writev with a bad piece");
+  if (pread(fd, a, 8, 0) != 8 || memcmp(a, "HELLO wo", 8) != 0)
+    err("writev with a bad piece wrote the wrong data");
+  if (close(fd) == -1)
+    err("close");
+  unlink(g);
+
+  printf("test pread/pwrite/readv/writev: PASS\n");
+  return 1;
+}
+
+int
+mega_test(void)
+{
+  int i;
+  char *p, *s;
+  struct mmapstat before, after;
+
+  testname = "megapages";
+  printf("test megapages\n");
+
+  // a 2MB-aligned block of anonymous memory takes one fault.
+  p = mmap(0, MEGASIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap (26)");
+  if ((uint64)p % MEGASIZE != 0)
+    err("large mapping not 2MB-aligned");
+  mmapstat(&before);
+  for (i = 0; i < MEGASIZE/PGSIZE; i++)
+    p[i*PGSIZE] = i;
+  mmapstat(&after);
+  if (after.megapages != before.megapages + 1 || after.faults != before.faults + 1)
+    err("block not mapped by one megapage");
+  for (i = 0; i < MEGASIZE; i += 1024)
+    if (p[i] != (i % PGSIZE == 0 ? (char)(i / PGSIZE) : 0))
+      err("megapage mismatch (1)");
+
+  // a private megapage is copy-on-write after fork.
+  if (child_status(poke, p) != 0)
+    err("child write to a megapage");
+  if (p[0] != 0 || p[PGSIZE*5] != 5)
+    err("parent sees the child's private write");
+
+  // protecting or unmapping part of one keeps the rest.
+  if (mprotect(p + PGSIZE, PGSIZE, PROT_READ) == -1)
+    err("mprotect");
+  if (child_status(poke, p + PGSIZE) == 0)
+    err("write to a read-only part of a megapage");
+  if (munmap(p + PGSIZE*2, PGSIZE) == -1)
+    err("munmap (25)");
+  if (child_status(peek, p + PGSIZE*2) == 0)
+    err("read of an unmapped part of a megapage");
+  if (p[PGSIZE] != 1 || p[PGSIZE*3] != 3 || p[MEGASIZE - PGSIZE] != (char)(MEGASIZE/PGSIZE - 1))
+    err("megapage mismatch (2)");
+  if (munmap(p, MEGASIZE*2) == -1)
+    err("munmap (26)");
+
+  // a block whose first touch is a read maps the zero page, so
+  // writing the rest of it must fall back to single pages.
+  p = mmap(0, MEGASIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap of a read-first block");
+  mmapstat(&before);
+  if (p[0] != 0)
+    err("read-first block not zeroed");
+  for (i = 1; i < MEGASIZE/PGSIZE; i++)
+    p[i*PGSIZE] = i;
+  mmapstat(&after);
+  if (after.megapages != before.megapages)
+    err("megapage over a mapped page");
+  for (i = 1; i < MEGASIZE/PGSIZE; i++)
+    if (p[i*PGSIZE] != (char)i)
+      err("read-first block mismatch");
+  if (munmap(p, MEGASIZE) == -1)
+    err("munmap of a read-first block");
+
+  // shared anonymous megapages are mapped at mmap and
+  // shared with the child.
+  mmapstat(&before);
+  s = mmap(0, MEGASIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (s == MAP_FAILED)
+    err("mmap (27)");
+  mmapstat(&after);
+  if (after.megapages != before.megapages + 1)
+    err("shared block not mapped by a megapage");
+  if (child_status(poke, s + PGSIZE*7) != 0 || s[PGSIZE*7] != 'W')
+    err("parent does not see the child's shared write");
+  if (munmap(s, MEGASIZE) == -1)
+    err("munmap (27)");
+
+  // MADV_NOHUGEPAGE keeps to pages.
+  p = mmap(0, MEGASIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap (28)");
+  if (madvise(p, MEGASIZE, MADV_NOHUGEPAGE) == -1)
+    err("madvise");
+  mmapstat(&before);
+  p[0] = 'x';
+  p[MEGASIZE - 1] = 'y';
+  mmapstat(&after);
+  if (after.megapages != before.megapages || after.faults != before.faults + 2)
+    err("MADV_NOHUGEPAGE mapping got a megapage");
+  if (munmap(p, MEGASIZE) == -1)
+    err("munmap (28)");
+
+  printf("test megapages: PASS\n");
+  return 1;
+}
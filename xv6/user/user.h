@@ -1,5 +1,8 @@
 struct stat;
 struct rtcdate;
+struct mmapstat;
+struct iovec;
+struct kmemstat;
 
 // system calls
 int fork(void);
@@ -23,11 +26,22 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int pread(int, void*, int, uint);
+int pwrite(int, const void*, int, uint);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
 //mp2
 void *mmap(void *, size_t, int, int,
            int, off_t);
 int munmap(void *, size_t);
 void vmprint();
+int msync(void *, size_t, int);
+int faultaround(void *, int);
+int mmapstat(struct mmapstat*);
+int madvise(void *, size_t, int);
+int mprotect(void *, size_t, int);
+void *mremap(void *, size_t, size_t, int);
+int kmemstat(struct kmemstat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
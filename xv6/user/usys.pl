@@ -40,3 +40,14 @@ entry("uptime");
 entry("mmap");
 entry("munmap");
 entry("vmprint");
+entry("msync");
+entry("faultaround");
+entry("mmapstat");
+entry("madvise");
+entry("mprotect");
+entry("mremap");
+entry("pread");
+entry("pwrite");
+entry("readv");
+entry("writev");
+entry("kmemstat");